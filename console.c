@@ -1,18 +1,24 @@
 /* Implementation of simple command-line interface */
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "console.h"
+#include "perf.h"
+#include "poller.h"
 #include "report.h"
+#include "sock.h"
 #include "web.h"
 
 /* Some global values */
@@ -20,6 +26,11 @@ int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+
+/* Hash tables for looking up commands and parameters by name */
+#define HASH_SIZE 64 /* Must be a power of 2 */
+static cmd_element_t *cmd_table[HASH_SIZE];
+static param_element_t *param_table[HASH_SIZE];
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -40,12 +51,21 @@ typedef struct __rio {
     int count;             /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *map;             /* Contents of regular file mapped in, or NULL */
+    size_t map_len;        /* Length of mapping */
+    char *map_pos;         /* Start of next line in mapping */
     struct __rio *prev;    /* Next element in stack */
 } rio_t;
 
 static rio_t *buf_stack;
 static char linebuf[RIO_BUFSIZE];
 
+/* Mapping of a file that has been popped, kept until the line taken from
+ * it is no longer in use
+ */
+static char *stale_map = NULL;
+static size_t stale_map_len = 0;
+
 /* Maximum file descriptor */
 static int fd_max = 0;
 
@@ -53,6 +73,11 @@ static int fd_max = 0;
 static int err_limit = 5;
 static int err_cnt = 0;
 static int echo = 0;
+static int async_output = 0;
+static int perf_counting = 0;
+
+/* Hardware events counted during most recently finished command */
+static perf_counts_t last_perf;
 
 static bool quit_flag = false;
 static char *prompt = "cmd> ";
@@ -65,6 +90,19 @@ static bool has_infile = false;
 static cmd_func_t quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+/* Optional functions adding samples to the web server's metrics page */
+static metrics_func_t metrics_helpers[MAXQUIT];
+static int metrics_helper_cnt = 0;
+
+/* Optional functions to call before every command */
+/* Maximum number of command hooks */
+
+#define MAXHOOK 10
+static cmd_hook_t cmd_hooks[MAXHOOK];
+static int cmd_hook_cnt = 0;
+static cmd_done_hook_t cmd_done_hooks[MAXHOOK];
+static int cmd_done_hook_cnt = 0;
+
 static void init_in();
 
 static bool push_file(char *fname);
@@ -72,6 +110,39 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* FNV-1a hash of string */
+static uint32_t hash_string(const char *str)
+{
+    uint32_t h = 2166136261u;
+    while (*str) {
+        h ^= (unsigned char) *str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Bucket of name in command and parameter tables */
+static unsigned hash_name(const char *name)
+{
+    return hash_string(name) & (HASH_SIZE - 1);
+}
+
+static cmd_element_t *find_cmd(const char *name)
+{
+    cmd_element_t *cmd = cmd_table[hash_name(name)];
+    while (cmd && strcmp(name, cmd->name) != 0)
+        cmd = cmd->hash_next;
+    return cmd;
+}
+
+static param_element_t *find_param(const char *name)
+{
+    param_element_t *param = param_table[hash_name(name)];
+    while (param && strcmp(name, param->name) != 0)
+        param = param->hash_next;
+    return param;
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
 {
@@ -87,8 +158,13 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->latency = NULL;
     cmd->next = next_cmd;
     *last_loc = cmd;
+
+    unsigned h = hash_name(name);
+    cmd->hash_next = cmd_table[h];
+    cmd_table[h] = cmd;
 }
 
 /* Add a new parameter */
@@ -109,53 +185,37 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+
+    unsigned h = hash_name(name);
+    param->hash_next = param_table[h];
+    param_table[h] = param;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/* Split a command line into arguments in place.
+ * White space in line is overwritten with null characters and the start of
+ * each word is stored in argv, which has room for maxargs entries.
+ * Return the number of words, which may exceed maxargs; in that case only
+ * the first maxargs are stored.
+ */
+static int parse_args(char *line, char *argv[], int maxargs)
 {
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
-
-    char *src = line;
-    char *dst = buf;
-    bool skipping = true;
-    int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
-        }
-    }
-
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+    char *p = line;
+    for (;;) {
+        while (isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0')
+            break;
+        if (argc < maxargs)
+            argv[argc] = p;
+        argc++;
+        while (*p != '\0' && !isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0')
+            break;
+        *p++ = '\0';
     }
-
-    free_block(buf, len + 1);
-    *argcp = argc;
-    return argv;
+    return argc;
 }
 
 static void record_error()
@@ -167,41 +227,421 @@ static void record_error()
     }
 }
 
+/* Execute a command that has already been looked up */
+static bool run_cmd(cmd_element_t *cmd, int argc, char *argv[])
+{
+    for (int i = 0; i < cmd_hook_cnt; i++)
+        cmd_hooks[i](argc, argv);
+    if (!cmd->latency) {
+        cmd->latency = malloc_or_fail(sizeof(histogram_t), "run_cmd");
+        hist_reset(cmd->latency);
+    }
+    perf_sample_t perf_start;
+    bool counting = perf_counting && perf_read(&perf_start);
+    uint64_t start = time_ns();
+    bool ok = cmd->operation(argc, argv);
+    uint64_t elapsed = time_ns() - start;
+    if (counting) {
+        perf_sample_t perf_end;
+        perf_read(&perf_end);
+        perf_delta(&perf_start, &perf_end, &last_perf);
+    }
+    hist_record(cmd->latency, elapsed);
+    for (int i = 0; i < cmd_done_hook_cnt; i++)
+        cmd_done_hooks[i](argc, argv, ok, elapsed);
+    if (!ok)
+        record_error();
+    return ok;
+}
+
+cmd_func_t find_command(const char *name)
+{
+    cmd_element_t *cmd = find_cmd(name);
+    return cmd ? cmd->operation : NULL;
+}
+
 /* Execute a command that has already been split into arguments */
 static bool interpret_cmda(int argc, char *argv[])
 {
     if (argc == 0)
         return true;
     /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
+    cmd_element_t *next_cmd = find_cmd(argv[0]);
+    if (!next_cmd) {
+        report(1, "Unknown command '%s'", argv[0]);
+        record_error();
+        return false;
+    }
+
+    return run_cmd(next_cmd, argc, argv);
+}
+
+bool run_command(int argc, char *argv[])
+{
+    return interpret_cmda(argc, argv);
+}
+
+/* Gather argc words of a line already split by parse_args */
+static void collect_args(char *line, int argc, char *argv[])
+{
+    char *p = line;
+    for (int i = 0; i < argc; i++) {
+        while (*p == '\0' || isspace((unsigned char) *p))
+            p++;
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+}
+
+/* Integer variables of the command language */
+#define MAXVARS 64
+#define VARNAME_LEN 32
+typedef struct {
+    char name[VARNAME_LEN];
+    bool defined;
+    long value;
+} var_t;
+
+static var_t vars[MAXVARS];
+static int var_cnt = 0;
+
+/* Find variable, optionally creating it.  Return NULL if not possible */
+static var_t *find_var(const char *name, bool create)
+{
+    for (int i = 0; i < var_cnt; i++) {
+        if (!strcmp(vars[i].name, name))
+            return &vars[i];
+    }
+    if (!create)
+        return NULL;
+    if (var_cnt >= MAXVARS || strlen(name) >= VARNAME_LEN || !*name) {
+        report(1, "Cannot create variable '%s'", name);
+        return NULL;
+    }
+    var_t *var = &vars[var_cnt++];
+    strcpy(var->name, name);
+    var->defined = false;
+    var->value = 0;
+    return var;
+}
+
+/* Extract long integer from text and store at loc */
+static bool get_long(char *vname, long *loc)
+{
+    char *end = NULL;
+    long v = strtol(vname, &end, 0);
+    if (v == LONG_MIN || v == LONG_MAX || *vname == '\0' || *end != '\0')
+        return false;
+
+    *loc = v;
+    return true;
+}
+
+/* Room for decimal value of variable */
+#define VALUE_LEN 24
+
+/* Replace reference to variable in word with its value.
+ * Return NULL if variable is not defined.
+ */
+static char *expand_var(var_t *var, char *buf)
+{
+    if (!var || !var->defined)
+        return NULL;
+    snprintf(buf, VALUE_LEN, "%ld", var->value);
+    return buf;
+}
+
+/* Statement in a loop body.  Words are split once, when the loop is read;
+ * only references to variables are filled in each time it is executed.
+ */
+typedef struct __stmt {
+    int argc;
+    char **words;        /* Words as read */
+    char **argv;         /* Words with variables expanded */
+    var_t **refs;        /* Variable referenced by each word, or NULL */
+    char *values;        /* Space for expanded values */
+    cmd_element_t *cmd;  /* Command to run, or NULL for nested loop */
+    struct __loop *loop; /* Nested loop */
+    struct __stmt *next;
+} stmt_t;
+
+/* Loop being read or run.  Header is 'repeat [var] count|lo..hi {' */
+typedef struct __loop {
+    stmt_t *header;
+    stmt_t *body;
+    stmt_t **tail;
+    struct __loop *parent;
+} loop_t;
+
+/* Innermost loop whose body is being read */
+static loop_t *open_loop = NULL;
+
+static void free_loop(loop_t *loop);
+
+static void free_stmt(stmt_t *stmt)
+{
+    if (stmt->argc) {
+        for (int i = 0; i < stmt->argc; i++)
+            free_string(stmt->words[i]);
+        free_array(stmt->words, stmt->argc, sizeof(char *));
+        free_array(stmt->argv, stmt->argc, sizeof(char *));
+        free_array(stmt->refs, stmt->argc, sizeof(var_t *));
+        free_array(stmt->values, stmt->argc, VALUE_LEN);
+    }
+    if (stmt->loop)
+        free_loop(stmt->loop);
+    free_block(stmt, sizeof(stmt_t));
+}
+
+static void free_loop(loop_t *loop)
+{
+    stmt_t *stmt = loop->body;
+    while (stmt) {
+        stmt_t *next = stmt->next;
+        free_stmt(stmt);
+        stmt = next;
+    }
+    if (loop->header)
+        free_stmt(loop->header);
+    free_block(loop, sizeof(loop_t));
+}
+
+static stmt_t *new_stmt(int argc, char *argv[])
+{
+    stmt_t *stmt = malloc_or_fail(sizeof(stmt_t), "new_stmt");
+    memset(stmt, 0, sizeof(stmt_t));
+    stmt->argc = argc;
+    if (!argc)
+        return stmt;
+    stmt->words = calloc_or_fail(argc, sizeof(char *), "new_stmt");
+    stmt->argv = calloc_or_fail(argc, sizeof(char *), "new_stmt");
+    stmt->refs = calloc_or_fail(argc, sizeof(var_t *), "new_stmt");
+    stmt->values = calloc_or_fail(argc, VALUE_LEN, "new_stmt");
+    for (int i = 0; i < argc; i++) {
+        stmt->words[i] = strsave_or_fail(argv[i], "new_stmt");
+        stmt->argv[i] = stmt->words[i];
+        if (argv[i][0] == '$')
+            stmt->refs[i] = find_var(argv[i] + 1, true);
+    }
+    return stmt;
+}
+
+/* Fill in variables of statement.  Return false if one is undefined */
+static bool expand_stmt(stmt_t *stmt)
+{
+    for (int i = 0; i < stmt->argc; i++) {
+        if (!stmt->refs[i])
+            continue;
+        stmt->argv[i] =
+            expand_var(stmt->refs[i], stmt->values + i * VALUE_LEN);
+        if (!stmt->argv[i]) {
+            report(1, "Undefined variable '%s'", stmt->words[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Value of number or variable reference at either end of range */
+static bool get_bound(char *text, long *loc)
+{
+    if (*text != '$')
+        return get_long(text, loc);
+    var_t *var = find_var(text + 1, false);
+    if (!var || !var->defined)
+        return false;
+    *loc = var->value;
+    return true;
+}
+
+/* Get bounds of loop from 'repeat [var] count|lo..hi {'.
+ * A count n stands for the range 1..n.
+ */
+static bool loop_bounds(int argc, char *argv[], var_t **var, long *lo,
+                        long *hi)
+{
+    *var = NULL;
+    if (argc == 4) {
+        *var = find_var(argv[1], true);
+        if (!*var)
+            return false;
+    }
+
+    char *range = argv[argc - 2];
+    char *dots = strstr(range, "..");
+    if (dots) {
+        *dots = '\0';
+        bool ok = get_bound(range, lo) && get_bound(dots + 2, hi);
+        *dots = '.';
+        if (ok)
+            return true;
+    } else if (get_long(range, hi)) {
+        *lo = 1;
+        return true;
+    }
+
+    report(1, "Invalid repeat count '%s'", range);
+    return false;
+}
+
+static bool run_loop(loop_t *loop);
+
+/* Execute statements of loop body once */
+static bool run_body(loop_t *loop)
+{
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
-    if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
-        if (!ok)
+    for (stmt_t *stmt = loop->body; stmt && !quit_flag; stmt = stmt->next) {
+        if (stmt->loop) {
+            ok = run_loop(stmt->loop) && ok;
+        } else if (!expand_stmt(stmt)) {
             record_error();
-    } else {
-        report(1, "Unknown command '%s'", argv[0]);
+            ok = false;
+        } else {
+            ok = run_cmd(stmt->cmd, stmt->argc, stmt->argv) && ok;
+        }
+    }
+    return ok;
+}
+
+static bool run_loop(loop_t *loop)
+{
+    stmt_t *header = loop->header;
+    var_t *var;
+    long lo, hi;
+    if (!expand_stmt(header) ||
+        !loop_bounds(header->argc, header->argv, &var, &lo, &hi)) {
         record_error();
-        ok = false;
+        return false;
     }
 
+    bool ok = true;
+    for (long i = lo; i <= hi && !quit_flag; i++) {
+        if (var) {
+            var->value = i;
+            var->defined = true;
+        }
+        ok = run_body(loop) && ok;
+    }
     return ok;
 }
 
-/* Execute a command from a command line */
+/* Take command line while a loop is being read, or one that starts a loop.
+ * Return false if the line is for the interpreter.
+ */
+static bool loop_line(int argc, char *argv[], bool *ok)
+{
+    *ok = true;
+    bool start = !strcmp(argv[0], "repeat");
+    if (!open_loop && !start)
+        return false;
+
+    if (start) {
+        if (argc < 3 || argc > 4 || strcmp(argv[argc - 1], "{")) {
+            report(1, "Usage: repeat [var] count|lo..hi {");
+            record_error();
+            *ok = false;
+            return true;
+        }
+        loop_t *loop = malloc_or_fail(sizeof(loop_t), "loop_line");
+        loop->header = new_stmt(argc, argv);
+        loop->body = NULL;
+        loop->tail = &loop->body;
+        loop->parent = open_loop;
+        if (open_loop) {
+            stmt_t *stmt = new_stmt(0, NULL);
+            stmt->loop = loop;
+            *open_loop->tail = stmt;
+            open_loop->tail = &stmt->next;
+        }
+        open_loop = loop;
+        return true;
+    }
+
+    if (argc == 1 && !strcmp(argv[0], "}")) {
+        loop_t *loop = open_loop;
+        open_loop = loop->parent;
+        if (!open_loop) {
+            *ok = run_loop(loop);
+            free_loop(loop);
+        }
+        return true;
+    }
+
+    cmd_element_t *cmd = find_cmd(argv[0]);
+    if (!cmd) {
+        report(1, "Unknown command '%s'", argv[0]);
+        record_error();
+        *ok = false;
+        return true;
+    }
+    stmt_t *stmt = new_stmt(argc, argv);
+    stmt->cmd = cmd;
+    *open_loop->tail = stmt;
+    open_loop->tail = &stmt->next;
+    return true;
+}
+
+static bool has_var_refs(int argc, char *argv[])
+{
+    for (int i = 0; i < argc; i++) {
+        if (argv[i][0] == '$')
+            return true;
+    }
+    return false;
+}
+
+/* Replace references to variables in command line with their values */
+static bool expand_args(int argc, char *argv[], char *values)
+{
+    for (int i = 0; i < argc; i++) {
+        if (argv[i][0] != '$')
+            continue;
+        char *value = expand_var(find_var(argv[i] + 1, false),
+                                 values + i * VALUE_LEN);
+        if (!value) {
+            report(1, "Undefined variable '%s'", argv[i]);
+            return false;
+        }
+        argv[i] = value;
+    }
+    return true;
+}
+
+/* Execute a command from a command line.
+ * The line is split into words in place, so its contents are destroyed.
+ */
+#define MAXARGS 64
 static bool interpret_cmd(char *cmdline)
 {
     if (quit_flag)
         return false;
 
-    int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    /* Nearly every command line fits here, so nothing is allocated */
+    char *argv_local[MAXARGS];
+    char **argv = argv_local;
+    int argc = parse_args(cmdline, argv, MAXARGS);
+    if (argc > MAXARGS) {
+        /* Words were separated in the first pass; collect them again */
+        argv = calloc_or_fail(argc, sizeof(char *), "interpret_cmd");
+        collect_args(cmdline, argc, argv);
+    }
+
+    bool ok;
+    if (argc && loop_line(argc, argv, &ok)) {
+        /* Line belongs to a loop */
+    } else if (argc && has_var_refs(argc, argv)) {
+        char *values = calloc_or_fail(argc, VALUE_LEN, "interpret_cmd");
+        ok = expand_args(argc, argv, values);
+        if (ok)
+            ok = interpret_cmda(argc, argv);
+        else
+            record_error();
+        free_array(values, argc, VALUE_LEN);
+    } else {
+        ok = interpret_cmda(argc, argv);
+    }
+    if (argv != argv_local)
+        free_array(argv, argc, sizeof(char *));
 
     return ok;
 }
@@ -215,6 +655,32 @@ void add_quit_helper(cmd_func_t qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+void add_metrics_helper(metrics_func_t mf)
+{
+    if (metrics_helper_cnt < MAXQUIT)
+        metrics_helpers[metrics_helper_cnt++] = mf;
+    else
+        report_event(MSG_FATAL, "Exceeded limit on metrics helpers");
+}
+
+/* Set function to be executed before every command */
+void add_cmd_hook(cmd_hook_t hook)
+{
+    if (cmd_hook_cnt < MAXHOOK)
+        cmd_hooks[cmd_hook_cnt++] = hook;
+    else
+        report_event(MSG_FATAL, "Exceeded limit on command hooks");
+}
+
+/* Set function to be executed after every command */
+void add_cmd_done_hook(cmd_done_hook_t hook)
+{
+    if (cmd_done_hook_cnt < MAXHOOK)
+        cmd_done_hooks[cmd_done_hook_cnt++] = hook;
+    else
+        report_event(MSG_FATAL, "Exceeded limit on command hooks");
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
@@ -229,6 +695,8 @@ static bool do_quit(int argc, char *argv[])
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
+        if (ele->latency)
+            free_block(ele->latency, sizeof(histogram_t));
         free_block(ele, sizeof(cmd_element_t));
     }
 
@@ -320,17 +788,14 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
+        /* Find parameter in table */
+        param_element_t *plist = find_param(name);
+        if (plist) {
+            int oldval = *plist->valp;
+            *plist->valp = value;
+            if (plist->setter)
+                plist->setter(oldval);
+            found = true;
         }
         /* Didn't find parameter */
         if (!found) {
@@ -357,6 +822,72 @@ static bool do_source(int argc, char *argv[])
     return true;
 }
 
+static bool do_set(int argc, char *argv[])
+{
+    if (argc == 1) {
+        for (int i = 0; i < var_cnt; i++) {
+            if (vars[i].defined)
+                report(1, "\t%s\t%ld", vars[i].name, vars[i].value);
+        }
+        return true;
+    }
+
+    if (argc != 3 && argc != 5) {
+        report(1, "Usage: %s name value [op value]", argv[0]);
+        return false;
+    }
+
+    long value, operand;
+    if (!get_long(argv[2], &value)) {
+        report(1, "Invalid value '%s'", argv[2]);
+        return false;
+    }
+    if (argc == 5) {
+        if (!get_long(argv[4], &operand)) {
+            report(1, "Invalid value '%s'", argv[4]);
+            return false;
+        }
+        char op = strlen(argv[3]) == 1 ? argv[3][0] : '\0';
+        if ((op == '/' || op == '%') && operand == 0) {
+            report(1, "Division by zero");
+            return false;
+        }
+        switch (op) {
+        case '+':
+            value += operand;
+            break;
+        case '-':
+            value -= operand;
+            break;
+        case '*':
+            value *= operand;
+            break;
+        case '/':
+            value /= operand;
+            break;
+        case '%':
+            value %= operand;
+            break;
+        default:
+            report(1, "Unknown operator '%s'", argv[3]);
+            return false;
+        }
+    }
+
+    var_t *var = find_var(argv[1], true);
+    if (!var)
+        return false;
+    var->value = value;
+    var->defined = true;
+    return true;
+}
+
+static bool do_repeat(int argc, char *argv[])
+{
+    report(1, "%s must begin a command line", argv[0]);
+    return false;
+}
+
 static bool do_log(int argc, char *argv[])
 {
     if (argc < 2) {
@@ -385,14 +916,381 @@ static bool do_time(int argc, char *argv[])
         } else {
             delta = delta_time(&last_time);
             report(1, "Delta time = %.3f", delta);
+            /* Counts were taken around the timed command itself */
+            if (perf_counting)
+                perf_report(1, &last_perf);
         }
     }
 
     return ok;
 }
 
+/* Run command that ought to be refused, such as one given bad arguments.
+ * Its failure is not counted as an error, and its success is.
+ */
+static bool do_mustfail(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "%s needs a command", argv[0]);
+        return false;
+    }
+
+    int errors = err_cnt;
+    bool quitting = quit_flag;
+    if (interpret_cmda(argc - 1, argv + 1)) {
+        report(1, "ERROR: '%s' succeeded, but should have failed", argv[1]);
+        return false;
+    }
+    err_cnt = errors;
+    quit_flag = quitting;
+    return true;
+}
+
+static bool do_latency(int argc, char *argv[])
+{
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        for (cmd_element_t *c = cmd_list; c; c = c->next) {
+            if (c->latency)
+                hist_reset(c->latency);
+        }
+        return true;
+    }
+
+    if (argc != 1) {
+        report(1, "%s takes no arguments or 'reset'", argv[0]);
+        return false;
+    }
+
+    report(1, "%-12s %10s %12s %12s %12s %12s %12s", "Command", "count",
+           "mean(ns)", "p50(ns)", "p99(ns)", "p999(ns)", "max(ns)");
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        histogram_t *h = c->latency;
+        if (!h || !h->count)
+            continue;
+        report(1,
+               "%-12s %10" PRIu64 " %12.0f %12" PRIu64 " %12" PRIu64
+               " %12" PRIu64 " %12" PRIu64,
+               c->name, h->count, hist_mean(h), hist_percentile(h, 50),
+               hist_percentile(h, 99), hist_percentile(h, 99.9), h->max);
+    }
+    return true;
+}
+
 static bool use_linenoise = true;
-static int web_fd;
+static int web_fd = -1;
+static int web_job_fd = -1;
+static int sock_fd = -1;
+
+/* Number of threads serving web connections */
+#define WEB_WORKERS 2
+
+/* Event loop.  The queue of web requests, the binary protocol socket and
+ * its connections, and the current input file are registered with
+ * poller.  Their tags are the address of web_job_fd or sock_fd, a
+ * sock_conn_t, or the address of watched_in_fd.  Input that cannot be
+ * polled, such as a regular file, is always ready.
+ */
+#define MAXEVENTS 64
+static poller_t *poller = NULL;
+static int watched_in_fd = -1;
+static bool watched_in_ok = false;
+
+static bool event_init()
+{
+    if (!poller)
+        poller = poller_new();
+    return poller;
+}
+
+static bool event_add(int fd, void *tag)
+{
+    return event_init() && poller_add(poller, fd, POLLIN, tag);
+}
+
+static void event_mod(int fd, uint32_t events, void *tag)
+{
+    poller_mod(poller, fd, events, tag);
+}
+
+static void event_del(int fd)
+{
+    poller_del(poller, fd);
+}
+
+static void unwatch_input()
+{
+    if (watched_in_ok)
+        event_del(watched_in_fd);
+    watched_in_fd = -1;
+    watched_in_ok = false;
+}
+
+/* Register input file with event loop.  Return false if it cannot be polled */
+static bool watch_input(int fd)
+{
+    if (fd != watched_in_fd) {
+        unwatch_input();
+        watched_in_fd = fd;
+        watched_in_ok = event_add(fd, &watched_in_fd);
+    }
+    return watched_in_ok;
+}
+
+static void sock_conn_close(sock_conn_t *conn)
+{
+    event_del(conn->fd);
+    close(conn->fd);
+    sock_conn_free(conn);
+    free_block(conn, sizeof(sock_conn_t));
+}
+
+/* Accept every connection waiting on binary protocol socket */
+static void sock_accept_all()
+{
+    int connfd;
+    while ((connfd = sock_accept(sock_fd)) >= 0) {
+        sock_conn_t *conn =
+            malloc_or_fail(sizeof(sock_conn_t), "sock_accept_all");
+        sock_conn_init(conn, connfd);
+        if (!event_add(connfd, conn))
+            sock_conn_close(conn);
+    }
+}
+
+/* Metrics page being built, in Prometheus text format */
+static web_buf_t *metrics_page = NULL;
+
+void metrics_printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    web_buf_vprintf(metrics_page, fmt, ap);
+    va_end(ap);
+}
+
+/* Build metrics page from counters, without running any command */
+static void metrics_build(web_buf_t *page)
+{
+    metrics_page = page;
+
+    metrics_printf("# HELP qtest_command_calls_total Commands executed.\n"
+                   "# TYPE qtest_command_calls_total counter\n");
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        if (c->latency)
+            metrics_printf(
+                "qtest_command_calls_total{cmd=\"%s\"} %" PRIu64 "\n",
+                c->name, c->latency->count);
+    }
+
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    metrics_printf("# HELP qtest_command_seconds Command execution time.\n"
+                   "# TYPE qtest_command_seconds summary\n");
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        histogram_t *h = c->latency;
+        if (!h || !h->count)
+            continue;
+        for (int i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+            metrics_printf(
+                "qtest_command_seconds{cmd=\"%s\",quantile=\"%g\"} %.9f\n",
+                c->name, quantiles[i],
+                1e-9 * hist_percentile(h, 100 * quantiles[i]));
+        metrics_printf("qtest_command_seconds_sum{cmd=\"%s\"} %.9f\n"
+                       "qtest_command_seconds_count{cmd=\"%s\"} %" PRIu64
+                       "\n",
+                       c->name, 1e-9 * h->sum, c->name, h->count);
+    }
+
+    metrics_printf("# HELP qtest_errors Errors counted toward error limit.\n"
+                   "# TYPE qtest_errors gauge\n"
+                   "qtest_errors %d\n",
+                   err_cnt);
+
+    size_t allocs, frees, current, peak;
+    alloc_stats(&allocs, &frees, &current, &peak);
+    metrics_printf(
+        "# HELP qtest_console_allocs_total Blocks allocated by console.\n"
+        "# TYPE qtest_console_allocs_total counter\n"
+        "qtest_console_allocs_total %zu\n"
+        "# HELP qtest_console_frees_total Blocks freed by console.\n"
+        "# TYPE qtest_console_frees_total counter\n"
+        "qtest_console_frees_total %zu\n"
+        "# HELP qtest_console_bytes Bytes allocated by console.\n"
+        "# TYPE qtest_console_bytes gauge\n"
+        "qtest_console_bytes %zu\n"
+        "# HELP qtest_console_peak_bytes Most bytes allocated by console.\n"
+        "# TYPE qtest_console_peak_bytes gauge\n"
+        "qtest_console_peak_bytes %zu\n",
+        allocs, frees, current, peak);
+
+    for (int i = 0; i < metrics_helper_cnt; i++)
+        metrics_helpers[i]();
+    metrics_page = NULL;
+}
+
+static void capture_buf(void *buf, const char *text, size_t len)
+{
+    web_buf_append(buf, text, len);
+}
+
+/* Run commands of batch, one per line, in order */
+static void web_run_batch(char *text)
+{
+    char *line = text;
+    while (line && !quit_flag) {
+        char *nl = strchr(line, '\n');
+        if (nl)
+            *nl = '\0';
+        size_t len = strlen(line);
+        if (len && line[len - 1] == '\r')
+            line[len - 1] = '\0';
+        interpret_cmd(line);
+        line = nl ? nl + 1 : NULL;
+    }
+}
+
+/* Run requests parsed by web workers, and hand back their responses */
+static void web_run_jobs()
+{
+    web_job_t *job;
+    while (!quit_flag && (job = web_pool_take())) {
+        if (job->status) {
+            /* Refused by worker; only answered in turn */
+        } else if (job->batch) {
+            set_report_capture(web_job_output, job);
+            web_run_batch(job->cmd);
+            set_report_capture(NULL, NULL);
+        } else if (!strcmp(job->cmd, "metrics")) {
+            metrics_build(&job->body);
+        } else if (!strcmp(job->cmd, "log")) {
+            /* 'log' without a file name fetches the log */
+            int fd = report_log_fd();
+            job->file_fd = fd >= 0 ? dup(fd) : -1;
+            if (job->file_fd < 0)
+                web_buf_append(&job->body, "No log file\n", 12);
+        } else {
+            set_report_capture(web_job_output, job);
+            interpret_cmd(job->cmd);
+            set_report_capture(NULL, NULL);
+        }
+        web_pool_done(job);
+    }
+}
+
+/* Select queue for binary protocol requests */
+static queue_select_t queue_select = NULL;
+
+void set_queue_selector(queue_select_t select)
+{
+    queue_select = select;
+}
+
+/* Run command of binary protocol request, capturing output in body */
+static bool sock_run(const sock_hdr_t *hdr, char *args[], web_buf_t *body)
+{
+    /* Opcode stands for command name, ahead of arguments */
+    int argc = hdr->argc;
+    char **argv = args;
+    if (hdr->op != SOCK_OP_CMD) {
+        const char *name = sock_op_name(hdr->op);
+        if (!name) {
+            web_buf_append(body, "Unknown opcode\n", 15);
+            return false;
+        }
+        argv = args - 1;
+        argv[0] = (char *) name;
+        argc++;
+    }
+    if (argc == 0) {
+        web_buf_append(body, "No command\n", 11);
+        return false;
+    }
+
+    if (hdr->queue != SOCK_CURRENT &&
+        (!queue_select || !queue_select(hdr->queue))) {
+        web_buf_append(body, "No such queue\n", 14);
+        return false;
+    }
+
+    cmd_element_t *cmd = find_cmd(argv[0]);
+    if (!cmd) {
+        report(1, "Unknown command '%s'", argv[0]);
+        record_error();
+        return false;
+    }
+    return run_cmd(cmd, argc, argv);
+}
+
+/* Stop reading from a client this far behind in taking its replies */
+#define SOCK_OUT_MAX (1 << 20)
+
+/* Read and write what binary protocol connection is ready for, and run
+ * every complete request received
+ */
+static void sock_conn_event(sock_conn_t *conn, uint32_t events)
+{
+    if ((events & (POLLIN | POLLHUP | POLLERR)) && !conn->eof &&
+        sock_conn_read(conn) < 0) {
+        sock_conn_close(conn);
+        return;
+    }
+
+    /* Room ahead of arguments for command name of opcode */
+    char *argv[UINT8_MAX + 2];
+    sock_hdr_t hdr;
+    int taken = 0;
+    web_buf_t body = {NULL, 0, 0};
+    while (!quit_flag && conn->out.len < SOCK_OUT_MAX &&
+           (taken = sock_conn_next(conn, &hdr, argv + 1, UINT8_MAX)) > 0) {
+        body.len = 0;
+        set_report_capture(capture_buf, &body);
+        bool ok = sock_run(&hdr, argv + 1, &body);
+        set_report_capture(NULL, NULL);
+        if (!sock_conn_reply(conn, &hdr, ok, body.data, body.len)) {
+            taken = -1;
+            break;
+        }
+    }
+    web_buf_free(&body);
+
+    /* Replies of everything taken go out in one batch */
+    int status = sock_conn_flush(conn);
+    if (taken < 0 || status < 0 || (status > 0 && conn->eof)) {
+        sock_conn_close(conn);
+        return;
+    }
+
+    uint32_t want = 0;
+    if (status == 0)
+        want |= POLLOUT;
+    if (!conn->eof && conn->out.len < SOCK_OUT_MAX)
+        want |= POLLIN;
+    event_mod(conn->fd, want, conn);
+}
+
+static bool do_sock(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs a socket path", argv[0]);
+        return false;
+    }
+    if (sock_fd >= 0) {
+        report(1, "Already listening on a socket");
+        return false;
+    }
+
+    sock_fd = sock_open(argv[1]);
+    if (sock_fd >= 0 && !event_add(sock_fd, &sock_fd)) {
+        close(sock_fd);
+        sock_fd = -1;
+    }
+    if (sock_fd < 0) {
+        report(1, "Could not listen on '%s'", argv[1]);
+        return false;
+    }
+    report(2, "Listening on '%s'", argv[1]);
+    use_linenoise = false;
+    return true;
+}
 
 static bool do_web(int argc, char *argv[])
 {
@@ -401,8 +1299,20 @@ static bool do_web(int argc, char *argv[])
         if (argv[1][0] >= '0' && argv[1][0] <= '9')
             port = atoi(argv[1]);
     }
+    if (web_fd >= 0) {
+        report(1, "Web server already running");
+        return false;
+    }
 
     web_fd = web_open(port);
+    if (web_fd > 0) {
+        web_job_fd = web_pool_start(web_fd, WEB_WORKERS);
+        if (web_job_fd < 0 || !event_add(web_job_fd, &web_job_fd)) {
+            web_pool_stop();
+            close(web_fd);
+            web_fd = -1;
+        }
+    }
     if (web_fd > 0) {
         printf("listen on port %d, fd is %d\n", port, web_fd);
         use_linenoise = false;
@@ -413,11 +1323,369 @@ static bool do_web(int argc, char *argv[])
     return true;
 }
 
+static void async_output_changed(int oldval)
+{
+    if (!set_async_output(async_output)) {
+        report(1, "Could not start output thread");
+        async_output = 0;
+    }
+}
+
+static void perf_changed(int oldval)
+{
+    if (!perf_counting) {
+        perf_close();
+        return;
+    }
+
+    int opened = perf_open();
+    if (!opened) {
+        report(1, "Could not open any performance counter");
+        perf_counting = 0;
+    } else if (opened < PERF_NCOUNTERS) {
+        report(1, "Opened %d of %d performance counters", opened,
+               PERF_NCOUNTERS);
+    }
+}
+
+/* Compiled command files.
+ * A program holds one fixed-size instruction per command line, with the
+ * command resolved to an index and the arguments already split, so that
+ * running it skips reading, tokenizing and looking up commands.
+ * Layout, in native byte order:
+ *
+ *   qtb_header_t header;
+ *   uint32_t cmds[header.ncmds];    Names of commands used, as pool offsets
+ *   qtb_insn_t insns[header.ninsns];
+ *   uint32_t args[header.nargs];    Arguments of all instructions, in order,
+ *                                   as pool offsets
+ *   char pool[header.pool_size];    Null-terminated strings, each stored once
+ */
+#define QTB_MAGIC "QTB1"
+#define QTB_MAXDEPTH 16 /* Maximum nesting of source commands */
+
+typedef struct {
+    char magic[4];
+    uint32_t ncmds;
+    uint32_t ninsns;
+    uint32_t nargs;
+    uint32_t pool_size;
+} qtb_header_t;
+
+typedef struct {
+    uint16_t cmd;  /* Index into command table */
+    uint16_t argc; /* Number of arguments, not counting command name */
+} qtb_insn_t;
+
+/* Growable byte buffer */
+typedef struct {
+    char *data;
+    size_t len, cap;
+} qtb_buf_t;
+
+typedef struct {
+    qtb_buf_t cmds, insns, args, pool;
+    uint32_t *strings; /* Hash table of pool offsets + 1, 0 = empty */
+    size_t nstrings, strings_cap;
+} qtb_builder_t;
+
+static void buf_append(qtb_buf_t *b, const void *p, size_t n)
+{
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + n)
+            cap *= 2;
+        char *data = malloc_or_fail(cap, "compile");
+        if (b->data) {
+            memcpy(data, b->data, b->len);
+            free_block(b->data, b->cap);
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void buf_free(qtb_buf_t *b)
+{
+    if (b->data)
+        free_block(b->data, b->cap);
+}
+
+/* Store string in pool, once.  Return its offset */
+static uint32_t pool_add(qtb_builder_t *qb, const char *str)
+{
+    if (2 * (qb->nstrings + 1) > qb->strings_cap) {
+        /* Grow and rehash */
+        size_t cap = qb->strings_cap ? 2 * qb->strings_cap : 1024;
+        uint32_t *strings = calloc_or_fail(cap, sizeof(uint32_t), "compile");
+        for (size_t i = 0; i < qb->strings_cap; i++) {
+            uint32_t off = qb->strings[i];
+            if (!off)
+                continue;
+            size_t h = hash_string(qb->pool.data + off - 1);
+            while (strings[h & (cap - 1)])
+                h++;
+            strings[h & (cap - 1)] = off;
+        }
+        if (qb->strings)
+            free_array(qb->strings, qb->strings_cap, sizeof(uint32_t));
+        qb->strings = strings;
+        qb->strings_cap = cap;
+    }
+
+    size_t h = hash_string(str);
+    for (;; h++) {
+        uint32_t off = qb->strings[h & (qb->strings_cap - 1)];
+        if (!off)
+            break;
+        if (!strcmp(qb->pool.data + off - 1, str))
+            return off - 1;
+    }
+
+    uint32_t off = qb->pool.len;
+    buf_append(&qb->pool, str, strlen(str) + 1);
+    qb->strings[h & (qb->strings_cap - 1)] = off + 1;
+    qb->nstrings++;
+    return off;
+}
+
+/* Index of command in program's command table, adding it if needed */
+static uint16_t cmd_index(qtb_builder_t *qb, cmd_element_t *cmd)
+{
+    uint32_t *cmds = (uint32_t *) qb->cmds.data;
+    size_t ncmds = qb->cmds.len / sizeof(uint32_t);
+    for (size_t i = 0; i < ncmds; i++) {
+        if (!strcmp(qb->pool.data + cmds[i], cmd->name))
+            return i;
+    }
+    uint32_t off = pool_add(qb, cmd->name);
+    buf_append(&qb->cmds, &off, sizeof(off));
+    return ncmds;
+}
+
+/* Translate a command file into instructions.  Return true if successful */
+static bool compile_lines(qtb_builder_t *qb, const char *file_name, int depth)
+{
+    FILE *f = fopen(file_name, "r");
+    if (!f) {
+        report(1, "Could not open source file '%s'", file_name);
+        return false;
+    }
+
+    bool ok = true;
+    char *line = NULL;
+    size_t cap = 0;
+    int lineno = 0;
+    while (ok && getline(&line, &cap, f) != -1) {
+        lineno++;
+        int argc = parse_args(line, NULL, 0);
+        if (argc == 0)
+            continue;
+        if (argc > UINT16_MAX) {
+            report(1, "%s:%d: Too many arguments", file_name, lineno);
+            ok = false;
+            break;
+        }
+        char **argv = calloc_or_fail(argc, sizeof(char *), "compile");
+        collect_args(line, argc, argv);
+
+        cmd_element_t *cmd = find_cmd(argv[0]);
+        if (!cmd) {
+            report(1, "%s:%d: Unknown command '%s'", file_name, lineno,
+                   argv[0]);
+            ok = false;
+        } else if (cmd->operation == do_repeat) {
+            report(1, "%s:%d: Loops cannot be compiled", file_name, lineno);
+            ok = false;
+        } else if (cmd->operation == do_set || has_var_refs(argc, argv)) {
+            /* Replay passes arguments as they are, without expanding them */
+            report(1, "%s:%d: Variables cannot be compiled", file_name,
+                   lineno);
+            ok = false;
+        } else if (cmd->operation == do_source) {
+            /* Sourced files become part of the program */
+            if (argc < 2) {
+                report(1, "%s:%d: No source file given", file_name, lineno);
+                ok = false;
+            } else if (depth >= QTB_MAXDEPTH) {
+                report(1, "%s:%d: Source files nested too deeply", file_name,
+                       lineno);
+                ok = false;
+            } else {
+                ok = compile_lines(qb, argv[1], depth + 1);
+            }
+        } else {
+            qtb_insn_t insn = {
+                .cmd = cmd_index(qb, cmd),
+                .argc = argc - 1,
+            };
+            buf_append(&qb->insns, &insn, sizeof(insn));
+            for (int i = 1; i < argc; i++) {
+                uint32_t off = pool_add(qb, argv[i]);
+                buf_append(&qb->args, &off, sizeof(off));
+            }
+        }
+        free_array(argv, argc, sizeof(char *));
+    }
+
+    free(line);
+    fclose(f);
+    return ok;
+}
+
+bool compile_file(const char *infile_name, const char *outfile_name)
+{
+    qtb_builder_t qb;
+    memset(&qb, 0, sizeof(qb));
+
+    bool ok = compile_lines(&qb, infile_name, 0);
+    if (ok) {
+        qtb_header_t header = {
+            .magic = QTB_MAGIC,
+            .ncmds = qb.cmds.len / sizeof(uint32_t),
+            .ninsns = qb.insns.len / sizeof(qtb_insn_t),
+            .nargs = qb.args.len / sizeof(uint32_t),
+            .pool_size = qb.pool.len,
+        };
+        FILE *f = fopen(outfile_name, "wb");
+        ok = f != NULL;
+        if (ok) {
+            ok = fwrite(&header, sizeof(header), 1, f) == 1;
+            const qtb_buf_t *parts[] = {&qb.cmds, &qb.insns, &qb.args,
+                                        &qb.pool};
+            for (int i = 0; ok && i < 4; i++)
+                ok = !parts[i]->len ||
+                     fwrite(parts[i]->data, parts[i]->len, 1, f) == 1;
+            ok = (fclose(f) == 0) && ok;
+        }
+        if (!ok)
+            report(1, "Could not write program file '%s'", outfile_name);
+        else
+            report(2, "Compiled %u commands into '%s'", header.ninsns,
+                   outfile_name);
+    }
+
+    buf_free(&qb.cmds);
+    buf_free(&qb.insns);
+    buf_free(&qb.args);
+    buf_free(&qb.pool);
+    if (qb.strings)
+        free_array(qb.strings, qb.strings_cap, sizeof(uint32_t));
+    return ok;
+}
+
+static bool do_compile(int argc, char *argv[])
+{
+    if (argc != 3) {
+        report(1, "%s needs a command file and a program file", argv[0]);
+        return false;
+    }
+
+    return compile_file(argv[1], argv[2]);
+}
+
+bool run_program(const char *file_name)
+{
+    int fd = open(file_name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        report(1, "ERROR: Could not open program file '%s'", file_name);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    char *image = malloc_or_fail(size + 1, "run_program");
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fd, image + got, size - got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    close(fd);
+
+    /* Locate and validate the sections */
+    qtb_header_t *header = (qtb_header_t *) image;
+    if (got != size || size < sizeof(qtb_header_t) ||
+        memcmp(header->magic, QTB_MAGIC, 4)) {
+        report(1, "ERROR: '%s' is not a valid program file", file_name);
+        free_block(image, size + 1);
+        return false;
+    }
+    size_t cmds_off = sizeof(qtb_header_t);
+    size_t insns_off = cmds_off + (size_t) header->ncmds * sizeof(uint32_t);
+    size_t args_off = insns_off + (size_t) header->ninsns * sizeof(qtb_insn_t);
+    size_t pool_off = args_off + (size_t) header->nargs * sizeof(uint32_t);
+    bool ok = pool_off + header->pool_size == size;
+    if (!ok) {
+        report(1, "ERROR: '%s' is not a valid program file", file_name);
+        free_block(image, size + 1);
+        return false;
+    }
+    /* Guarantee the last string is terminated */
+    image[size] = '\0';
+
+    uint32_t *cmd_names = (uint32_t *) (image + cmds_off);
+    qtb_insn_t *insns = (qtb_insn_t *) (image + insns_off);
+    uint32_t *args = (uint32_t *) (image + args_off);
+    char *pool = image + pool_off;
+
+    /* Resolve command names and build argument vectors up front */
+    size_t ncmds = header->ncmds, ninsns = header->ninsns;
+    size_t nargv = ninsns + header->nargs;
+    cmd_element_t **cmds =
+        calloc_or_fail(ncmds ? ncmds : 1, sizeof(cmd_element_t *), "run");
+    char **argvs = calloc_or_fail(nargv ? nargv : 1, sizeof(char *), "run");
+    for (size_t i = 0; ok && i < ncmds; i++) {
+        if (cmd_names[i] >= header->pool_size ||
+            !(cmds[i] = find_cmd(pool + cmd_names[i]))) {
+            report(1, "ERROR: Program uses unknown command '%s'",
+                   cmd_names[i] < header->pool_size ? pool + cmd_names[i]
+                                                    : "?");
+            ok = false;
+        }
+    }
+    size_t a = 0, v = 0;
+    for (size_t i = 0; ok && i < ninsns; i++) {
+        if (insns[i].cmd >= ncmds || a + insns[i].argc > header->nargs) {
+            ok = false;
+            break;
+        }
+        argvs[v++] = cmds[insns[i].cmd]->name;
+        for (int j = 0; ok && j < insns[i].argc; j++, a++) {
+            ok = args[a] < header->pool_size;
+            argvs[v++] = pool + args[a];
+        }
+    }
+    if (!ok)
+        report(1, "ERROR: '%s' is not a valid program file", file_name);
+
+    /* Execute.  Like commands read from a file, these are not echoed */
+    set_echo(0);
+    char **argv = argvs;
+    for (size_t i = 0; ok && i < ninsns && !quit_flag; i++) {
+        int argc = insns[i].argc + 1;
+        run_cmd(cmds[insns[i].cmd], argc, argv);
+        argv += argc;
+    }
+
+    free_array(argvs, nargv ? nargv : 1, sizeof(char *));
+    free_array(cmds, ncmds ? ncmds : 1, sizeof(cmd_element_t *));
+    free_block(image, size + 1);
+    return ok && err_cnt == 0;
+}
+
 /* Initialize interpreter */
 void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
     err_cnt = 0;
     quit_flag = false;
 
@@ -427,15 +1695,33 @@ void init_cmd()
                 "[name val]");
     ADD_COMMAND(quit, "Exit program", "");
     ADD_COMMAND(source, "Read commands from source file", "");
+    ADD_COMMAND(compile, "Compile command file into program for qtest -b",
+                "file prog");
     ADD_COMMAND(log, "Copy output to file", "file");
+    ADD_COMMAND(set, "Set or show integer variables, used as $name",
+                "[name val [op val]]");
+    ADD_COMMAND(repeat, "Run commands up to '}' for each value of range",
+                "[var] count|lo..hi {");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
+    ADD_COMMAND(mustfail, "Run command, which is expected to fail",
+                "cmd arg ...");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
+    ADD_COMMAND(sock, "Read binary protocol commands from Unix domain socket",
+                "path");
+    ADD_COMMAND(latency,
+                "Show latency percentiles of each command, or clear them",
+                "[reset]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("async", &async_output,
+              "Write output from a background thread", async_output_changed);
+    add_param("perf", &perf_counting,
+              "Count hardware events of each command, shown by time",
+              perf_changed);
 
     init_in();
     init_time(&last_time);
@@ -460,18 +1746,54 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->count = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_len = 0;
+    rnew->map_pos = NULL;
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
+    /* Named regular files are mapped, so that lines can be handed to the
+     * interpreter where they are.  The mapping is private and writable,
+     * since the interpreter splits lines in place.  Anything else, such as
+     * stdin or a pipe, is read through the buffer.
+     */
+    struct stat st;
+    if (fname && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            rnew->map = map;
+            rnew->map_len = st.st_size;
+            rnew->map_pos = map;
+        }
+    }
+
     return true;
 }
 
+static void release_stale_map()
+{
+    if (stale_map) {
+        munmap(stale_map, stale_map_len);
+        stale_map = NULL;
+    }
+}
+
 /* Pop a file buffer from stack */
 static void pop_file()
 {
     if (buf_stack) {
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->fd == watched_in_fd)
+            unwatch_input();
+        if (rsave->map) {
+            /* The command being run may still point into the mapping */
+            release_stale_map();
+            stale_map = rsave->map;
+            stale_map_len = rsave->map_len;
+        }
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -483,6 +1805,45 @@ static void init_in()
     buf_stack = NULL;
 }
 
+/* Read command from mapped file, in place.
+ * When hit EOF, close that file and return NULL
+ */
+static char *readline_mapped()
+{
+    rio_t *r = buf_stack;
+    char *end = r->map + r->map_len;
+    if (r->map_pos >= end) {
+        pop_file();
+        return NULL;
+    }
+
+    char *line = r->map_pos;
+    char *nl = memchr(line, '\n', end - line);
+    if (!nl) {
+        /* Last line of file did not terminate with newline.  There is no
+         * room to terminate it in the mapping, so copy it out.
+         */
+        size_t len = end - line;
+        if (len > RIO_BUFSIZE - 2)
+            len = RIO_BUFSIZE - 2;
+        memcpy(linebuf, line, len);
+        linebuf[len] = '\n';
+        linebuf[len + 1] = '\0';
+        r->map_pos = end;
+        line = linebuf;
+    } else {
+        *nl = '\0';
+        r->map_pos = nl + 1;
+    }
+
+    if (echo) {
+        report_noreturn(1, prompt);
+        report(1, "%s", line);
+    }
+
+    return line;
+}
+
 /* Read command from input file.
  * When hit EOF, close that file and return NULL
  */
@@ -491,9 +1852,15 @@ static char *readline()
     char c;
     char *lptr = linebuf;
 
+    /* Previous line is done with */
+    release_stale_map();
+
     if (!buf_stack)
         return NULL;
 
+    if (buf_stack->map)
+        return readline_mapped();
+
     for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
         if (buf_stack->count <= 0) {
             /* Need to read from input file */
@@ -544,86 +1911,66 @@ static bool cmd_done()
     return !buf_stack || quit_flag;
 }
 
-/* Handle command processing in program that uses select as main control loop.
- * Like select, but checks whether command input either present in internal
- * buffer
- * or readable from command input.  If so, that command is executed.
- * Same return as select.  Command input file removed from readfds
- *
- * nfds should be set to the maximum file descriptor for network sockets.
- * If nfds == 0, this indicates that there is no pending network activity
+/* Handle command processing in program that uses poller as main control loop.
+ * Wait up to timeout milliseconds, or without limit if timeout is -1, for
+ * command input or web activity.  Every web request that has arrived is
+ * served, and one line of command input is executed.
+ * Return number of events, 0 if none, or -1 on error.
  */
-int web_connfd;
-static int cmd_select(int nfds,
-                      fd_set *readfds,
-                      fd_set *writefds,
-                      fd_set *exceptfds,
-                      struct timeval *timeout)
+static int cmd_select(int timeout)
 {
-    int infd;
-    fd_set local_readset;
-
     if (cmd_done())
         return 0;
 
-    if (!block_flag) {
-        /* Process any commands in input buffer */
-        if (!readfds)
-            readfds = &local_readset;
-
-        /* Add input fd to readset for select */
-        infd = buf_stack->fd;
-        FD_ZERO(readfds);
-        FD_SET(infd, readfds);
+    if (!block_flag && buf_stack->map) {
+        /* Mapped file is always ready; skip polling */
+        set_echo(0);
+        char *cmdline = readline();
+        if (cmdline)
+            interpret_cmd(cmdline);
+        return 1;
+    }
 
-        /* If web not ready listen */
-        if (web_fd != -1)
-            FD_SET(web_fd, readfds);
+    bool input_ready = false;
+    if (!block_flag) {
+        /* Buffered or unpollable input need not be waited for */
+        int infd = buf_stack->fd;
+        input_ready = buf_stack->count > 0 || !watch_input(infd);
 
-        if (infd == STDIN_FILENO && prompt_flag) {
+        if (infd == STDIN_FILENO && prompt_flag && !input_ready) {
+            report_flush();
             printf("%s", prompt);
             fflush(stdout);
             prompt_flag = true;
         }
-
-        if (infd >= nfds)
-            nfds = infd + 1;
-        if (web_fd >= nfds)
-            nfds = web_fd + 1;
     }
-    if (nfds == 0)
-        return 0;
-
-    int result = select(nfds, readfds, writefds, exceptfds, timeout);
-    if (result <= 0)
-        return result;
+    if (!event_init())
+        return -1;
+
+    poller_event_t events[MAXEVENTS];
+    int result =
+        poller_wait(poller, events, MAXEVENTS, input_ready ? 0 : timeout);
+    if (result < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (int i = 0; i < result; i++) {
+        void *tag = events[i].tag;
+        if (tag == &watched_in_fd)
+            input_ready = !block_flag;
+        else if (tag == &web_job_fd)
+            web_run_jobs();
+        else if (tag == &sock_fd)
+            sock_accept_all();
+        else
+            sock_conn_event(tag, events[i].events);
+    }
 
-    infd = buf_stack->fd;
-    if (readfds && FD_ISSET(infd, readfds)) {
+    if (input_ready && !cmd_done()) {
         /* Commandline input available */
-        FD_CLR(infd, readfds);
-        result--;
-
         set_echo(0);
         char *cmdline = readline();
         if (cmdline)
             interpret_cmd(cmdline);
-    } else if (readfds && FD_ISSET(web_fd, readfds)) {
-        FD_CLR(web_fd, readfds);
-        result--;
-        struct sockaddr_in clientaddr;
-        socklen_t clientlen = sizeof(clientaddr);
-        web_connfd =
-            accept(web_fd, (struct sockaddr *) &clientaddr, &clientlen);
-
-        char *p = web_recv(web_connfd, &clientaddr);
-        char *buffer = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
-        web_send(web_connfd, buffer);
-
-        if (p)
-            interpret_cmd(p);
-        free(p);
-        close(web_connfd);
     }
     return result;
 }
@@ -633,6 +1980,15 @@ bool finish_cmd()
     bool ok = true;
     if (!quit_flag)
         ok = ok && do_quit(0, NULL);
+    release_stale_map();
+    if (open_loop) {
+        report(1, "Loop not closed with '}'");
+        while (open_loop->parent)
+            open_loop = open_loop->parent;
+        free_loop(open_loop);
+        open_loop = NULL;
+        ok = false;
+    }
     has_infile = false;
     return ok && err_cnt == 0;
 }
@@ -687,22 +2043,27 @@ bool run_console(char *infile_name)
 
     if (!has_infile) {
         char *cmdline;
-        while (use_linenoise && (cmdline = linenoise(prompt))) {
-            interpret_cmd(cmdline);
+        while (use_linenoise) {
+            /* Pending output must appear before the prompt */
+            report_flush();
+            if (!(cmdline = linenoise(prompt)))
+                break;
+            /* Record line before interpret_cmd splits it up */
             line_history_add(cmdline);       /* Add to the history. */
+            interpret_cmd(cmdline);
             line_history_save(HISTORY_FILE); /* Save the history on disk. */
             line_free(cmdline);
             while (buf_stack && buf_stack->fd != STDIN_FILENO)
-                cmd_select(0, NULL, NULL, NULL, NULL);
+                cmd_select(-1);
             has_infile = false;
         }
         if (!use_linenoise) {
             while (!cmd_done())
-                cmd_select(0, NULL, NULL, NULL, NULL);
+                cmd_select(-1);
         }
     } else {
         while (!cmd_done())
-            cmd_select(0, NULL, NULL, NULL, NULL);
+            cmd_select(-1);
     }
 
     return err_cnt == 0;
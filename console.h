@@ -2,8 +2,10 @@
 #define LAB0_CONSOLE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/select.h>
 
+#include "histogram.h"
 #include "linenoise.h"
 
 #define HISTORY_FILE ".cmd_history"
@@ -18,13 +20,17 @@ typedef bool (*cmd_func_t)(int argc, char *argv[]);
 
 /* Information about each command */
 
-/* Organized as linked list in alphabetical order */
+/* Organized as linked list in alphabetical order, for listing, and also
+ * chained into a hash table, for lookup by name
+ */
 typedef struct __cmd_element {
     char *name;
     cmd_func_t operation;
     char *summary;
     char *param;
+    histogram_t *latency; /* Execution times in ns, allocated on first use */
     struct __cmd_element *next;
+    struct __cmd_element *hash_next; /* Next command in same hash bucket */
 } cmd_element_t;
 
 /* Optionally supply function that gets invoked when parameter changes */
@@ -38,6 +44,7 @@ typedef struct __param_element {
     /* Function that gets called whenever parameter changes */
     setter_func_t setter;
     struct __param_element *next;
+    struct __param_element *hash_next; /* Next parameter in same bucket */
 } param_element_t;
 
 /* Initialize interpreter */
@@ -50,12 +57,51 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *parameter);
 /* Add a new parameter */
 void add_param(char *name, int *valp, char *summary, setter_func_t setter);
 
+/* Function of named command, or NULL if there is no such command */
+cmd_func_t find_command(const char *name);
+
+/* Run command as the interpreter would, including the hooks added below */
+bool run_command(int argc, char *argv[]);
+
 /* Extract integer from text and store at loc */
 bool get_int(char *vname, int *loc);
 
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
+/* Make queue with id current, for requests of binary protocol clients.
+ * Return false if there is no such queue.
+ */
+typedef bool (*queue_select_t)(int id);
+
+void set_queue_selector(queue_select_t select);
+
+/* Function adding samples to the web server's /metrics page */
+typedef void (*metrics_func_t)(void);
+
+/* Add function to be called whenever /metrics is requested */
+void add_metrics_helper(metrics_func_t mf);
+
+/* Append text, in Prometheus text format, to /metrics page being built */
+void metrics_printf(const char *fmt, ...);
+
+/* Optionally supply function that gets invoked before every command */
+typedef void (*cmd_hook_t)(int argc, char *argv[]);
+
+/* Add function to be executed before every command */
+void add_cmd_hook(cmd_hook_t hook);
+
+/* Optionally supply function that gets invoked after every command,
+ * with its result and execution time in nanoseconds
+ */
+typedef void (*cmd_done_hook_t)(int argc,
+                                char *argv[],
+                                bool ok,
+                                uint64_t elapsed);
+
+/* Add function to be executed after every command */
+void add_cmd_done_hook(cmd_done_hook_t hook);
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
@@ -68,6 +114,17 @@ bool finish_cmd();
  */
 bool run_console(char *infile_name);
 
+/* Compile command file into a program that run_program executes.  Loops
+ * and variables are refused, since the program only replays commands.
+ * Return true if successful
+ */
+bool compile_file(const char *infile_name, const char *outfile_name);
+
+/* Run commands of a program created by compile_file.
+ * Return true if no errors occurred
+ */
+bool run_program(const char *file_name);
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, line_completions_t *lc);
 
@@ -1,10 +1,21 @@
 /* Test support code */
 
+/* dladdr() and Dl_info are GNU extensions on glibc */
+#if defined(__linux__) || defined(__GNU__)
+#define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "report.h"
@@ -29,42 +40,305 @@
 
 /* Data structures used by our code */
 
+/* Allocation statistics of one call site, i.e. the return address of the
+ * test_malloc/test_calloc/test_strdup call.  Sites live in a fixed-size
+ * open-addressing table that is filled lock-free, so profiling does not
+ * serialize threads that allocate concurrently.
+ */
+typedef struct {
+    void *_Atomic site;
+    atomic_size_t allocs;
+    atomic_size_t bytes;
+    atomic_size_t live_blocks;
+    atomic_size_t live_bytes;
+} alloc_site_t;
+
+#define SITE_TABLE_SIZE 1024 /* Must be a power of 2 */
+
+/* Last slot collects allocations from sites that no longer fit */
+static alloc_site_t site_table[SITE_TABLE_SIZE + 1];
+
+struct __thread_cache;
+
 /* Represent allocated blocks as doubly-linked list, with
  * next and prev pointers at beginning
  */
 typedef struct __block_element {
     struct __block_element *next, *prev;
+    struct __thread_cache *owner; /* Thread cache holding this block */
+    alloc_site_t *site;           /* Call site that allocated this block */
+    mem_account_t *account;       /* Queue this block is charged to */
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Each thread keeps its own list of allocated blocks, so that threads
+ * allocating concurrently only ever take their own (uncontended) lock.
+ * All caches are chained into a global registry, which is used to merge
+ * the counts and to search for blocks in cautious mode.  The cache of an
+ * exiting thread is retired rather than released, so blocks it leaked are
+ * still reported, and it is handed over to the next new thread.
+ */
+typedef struct __thread_cache {
+    block_element_t *allocated;
+    size_t allocated_count;
+    size_t total_allocs; /* Allocations ever made by this thread */
+    size_t total_bytes;  /* Bytes ever allocated by this thread */
+    pthread_mutex_t lock;
+    bool retired;
+    struct __thread_cache *next;
+} thread_cache_t;
+
+static thread_cache_t *cache_list = NULL;
+static pthread_mutex_t cache_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static __thread thread_cache_t *self_cache = NULL;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Scheduled failures.  Allocations are counted from the last time the
+ * schedule was changed; 0 disables the corresponding rule.
+ */
+int fail_nth = 0;   /* Fail the nth allocation */
+int fail_every = 0; /* Fail every kth allocation */
+int fail_size = 0;  /* Fail allocations larger than this many bytes */
+int fail_seed = 0;  /* Seed of failure stream (0 = pick one at random) */
+
+/* Only inject faults while this command runs (NULL = any command) */
+static char *fault_cmd = NULL;
+static bool fault_cmd_active = true;
+
+/* Any rule enabled and in scope.  This is the only thing test_malloc
+ * checks when fault injection is off.
+ */
+static bool fault_armed = false;
+
+static atomic_ulong fault_count = 0;
+static uint32_t fault_threshold = 0;
+static atomic_uint fault_generation = 0;
+
+/* Per-thread xorshift stream, reseeded whenever the generation changes */
+static __thread uint64_t fault_rng = 0;
+static __thread unsigned fault_rng_generation = 0;
+static __thread unsigned fault_thread_id = 0;
+static uint64_t fault_rng_seed = 0;
+
+/* Memory quota of each queue in bytes (0 = unlimited) */
+int mem_quota = 0;
+
+/* Account charged for allocations, or NULL */
+static mem_account_t *_Atomic cur_account = NULL;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+static atomic_bool error_occurred = false;
+
+/* Time budget of a guarded operation, in milliseconds (0 = unlimited) */
+int time_budget = 1000;
+
+/* Report time used by every guarded operation */
+int show_guard_time = 0;
+
+/* Budgets of individual commands, overriding time_budget */
+typedef struct __budget_element {
+    char *name;
+    int budget;
+    struct __budget_element *next;
+} budget_element_t;
 
-static int time_limit = 1;
+static budget_element_t *budget_list = NULL;
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+/* Budget of running command, or -1 to use time_budget */
+static int cmd_budget = -1;
+
+/* Data for managing exceptions.  Every thread has its own context, so a
+ * failure in one thread unwinds to the exception_setup of that thread.
+ */
+typedef struct {
+    sigjmp_buf env;
+    volatile sig_atomic_t jmp_ready;
+    volatile sig_atomic_t deferred; /* Depth of sections not to unwind */
+    volatile sig_atomic_t pending;  /* Exception raised while deferred */
+    bool time_limited;
+    int budget;            /* Armed budget in milliseconds */
+    struct timespec start; /* When guarded operation started */
+    char *error_message;
+} exception_context_t;
+
+static __thread exception_context_t exc = {.error_message = ""};
 
 /* Internal functions */
 
+/* An exception raised by the time limit must not unwind out of a block
+ * list halfway through being updated, nor out of malloc() or free().  It is
+ * held back until the section doing so is left.
+ */
+static void defer_exceptions()
+{
+    exc.deferred++;
+    atomic_signal_fence(memory_order_seq_cst);
+}
+
+static void allow_exceptions()
+{
+    atomic_signal_fence(memory_order_seq_cst);
+    if (--exc.deferred == 0 && exc.pending) {
+        exc.pending = false;
+        trigger_exception(exc.error_message);
+    }
+}
+
+static void lock_blocks(pthread_mutex_t *lock)
+{
+    defer_exceptions();
+    pthread_mutex_lock(lock);
+}
+
+static void unlock_blocks(pthread_mutex_t *lock)
+{
+    pthread_mutex_unlock(lock);
+    allow_exceptions();
+}
+
+/* Mark cache of exiting thread as available for reuse */
+static void retire_cache(void *arg)
+{
+    thread_cache_t *cache = arg;
+    lock_blocks(&cache_list_lock);
+    cache->retired = true;
+    unlock_blocks(&cache_list_lock);
+}
+
+static void make_cache_key()
+{
+    pthread_key_create(&cache_key, retire_cache);
+}
+
+/* Find cache of calling thread, attaching one on first use */
+static thread_cache_t *get_cache()
+{
+    if (self_cache)
+        return self_cache;
+
+    pthread_once(&cache_key_once, make_cache_key);
+
+    lock_blocks(&cache_list_lock);
+    thread_cache_t *cache = cache_list;
+    while (cache && !cache->retired)
+        cache = cache->next;
+    if (cache) {
+        cache->retired = false;
+    } else {
+        cache = malloc(sizeof(thread_cache_t));
+        if (!cache) {
+            unlock_blocks(&cache_list_lock);
+            report_event(MSG_FATAL, "Couldn't allocate thread cache");
+            return NULL;
+        }
+        cache->allocated = NULL;
+        cache->allocated_count = 0;
+        cache->total_allocs = 0;
+        cache->total_bytes = 0;
+        pthread_mutex_init(&cache->lock, NULL);
+        cache->retired = false;
+        cache->next = cache_list;
+        cache_list = cache;
+    }
+    unlock_blocks(&cache_list_lock);
+
+    pthread_setspecific(cache_key, cache);
+    self_cache = cache;
+    return cache;
+}
+
+/* Is block b currently on the list of any thread cache? */
+static bool block_allocated(block_element_t *b)
+{
+    bool found = false;
+    lock_blocks(&cache_list_lock);
+    for (thread_cache_t *cache = cache_list; cache && !found;
+         cache = cache->next) {
+        pthread_mutex_lock(&cache->lock);
+        block_element_t *ab = cache->allocated;
+        while (ab && !found) {
+            found = ab == b;
+            ab = ab->next;
+        }
+        pthread_mutex_unlock(&cache->lock);
+    }
+    unlock_blocks(&cache_list_lock);
+    return found;
+}
+
+/* Find statistics entry for call site, creating it on first use */
+static alloc_site_t *find_site(void *site)
+{
+    size_t h = ((uintptr_t) site >> 2) * 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < SITE_TABLE_SIZE; i++) {
+        alloc_site_t *entry = &site_table[(h + i) & (SITE_TABLE_SIZE - 1)];
+        void *cur = atomic_load_explicit(&entry->site, memory_order_acquire);
+        if (cur == site)
+            return entry;
+        if (!cur) {
+            if (atomic_compare_exchange_strong(&entry->site, &cur, site) ||
+                cur == site)
+                return entry;
+        }
+    }
+    return &site_table[SITE_TABLE_SIZE];
+}
+
+static void site_alloc(alloc_site_t *entry, size_t size)
+{
+    atomic_fetch_add_explicit(&entry->allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&entry->bytes, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&entry->live_blocks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&entry->live_bytes, size, memory_order_relaxed);
+}
+
+static void site_free(alloc_site_t *entry, size_t size)
+{
+    atomic_fetch_sub_explicit(&entry->live_blocks, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&entry->live_bytes, size, memory_order_relaxed);
+}
+
+static uint64_t fault_next()
+{
+    static atomic_uint thread_seq = 0;
+    if (!fault_thread_id)
+        fault_thread_id = atomic_fetch_add(&thread_seq, 1) + 1;
+
+    unsigned gen =
+        atomic_load_explicit(&fault_generation, memory_order_relaxed);
+    if (fault_rng_generation != gen || !fault_rng) {
+        /* Every thread gets a distinct, but reproducible, stream */
+        fault_rng = fault_rng_seed ^ (0x9E3779B97F4A7C15ULL * fault_thread_id);
+        fault_rng_generation = gen;
+    }
+    /* xorshift64 */
+    fault_rng ^= fault_rng << 13;
+    fault_rng ^= fault_rng >> 7;
+    fault_rng ^= fault_rng << 17;
+    return fault_rng;
+}
+
 /* Should this allocation fail? */
-static bool fail_allocation()
+static bool fail_allocation(size_t size)
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    unsigned long n =
+        atomic_fetch_add_explicit(&fault_count, 1, memory_order_relaxed) + 1;
+    if (fail_nth > 0 && n == (unsigned long) fail_nth)
+        return true;
+    if (fail_every > 0 && n % fail_every == 0)
+        return true;
+    if (fail_size > 0 && size > (size_t) fail_size)
+        return true;
+    return fault_threshold &&
+           (uint32_t) (fault_next() >> 32) < fault_threshold;
 }
 
 /* Find header of block, given its payload.
@@ -81,13 +355,7 @@ static block_element_t *find_header(void *p)
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (!block_allocated(b)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
@@ -117,23 +385,37 @@ static size_t *find_footer(block_element_t *b)
 
 /* Implementation of application functions */
 
-void *test_malloc(size_t size)
+/* Allocate a tracked block on behalf of the code at address site */
+static void *alloc_block(size_t size, void *site)
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to malloc disallowed");
         return NULL;
     }
 
-    if (fail_allocation()) {
+    if (__builtin_expect(fault_armed, 0) && fail_allocation(size)) {
         report_event(MSG_WARN, "Malloc returning NULL");
         return NULL;
     }
 
+    mem_account_t *account = atomic_load(&cur_account);
+    if (account && mem_quota > 0 &&
+        atomic_load(&account->bytes) + size > (size_t) mem_quota) {
+        report_event(MSG_WARN,
+                     "Malloc returning NULL: queue memory quota of %d bytes "
+                     "exceeded",
+                     mem_quota);
+        return NULL;
+    }
+
+    defer_exceptions();
     block_element_t *new_block =
         malloc(size + sizeof(block_element_t) + sizeof(size_t));
     if (!new_block) {
+        allow_exceptions();
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
+        return NULL;
     }
 
     // cppcheck-suppress nullPointerRedundantCheck
@@ -143,27 +425,57 @@ void *test_malloc(size_t size)
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, FILLCHAR, size);
+
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->site = find_site(site);
+    site_alloc(new_block->site, size);
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->account = account;
+    if (account) {
+        atomic_fetch_add(&account->bytes, size);
+        atomic_fetch_add(&account->blocks, 1);
+    }
+
+    thread_cache_t *cache = get_cache();
+    pthread_mutex_lock(&cache->lock);
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->owner = cache;
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
+    new_block->next = cache->allocated;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->prev = NULL;
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    if (cache->allocated)
+        cache->allocated->prev = new_block;
+    cache->allocated = new_block;
+    cache->allocated_count++;
+    cache->total_allocs++;
+    cache->total_bytes += size;
+    pthread_mutex_unlock(&cache->lock);
+    allow_exceptions();
 
     return p;
 }
 
+void *test_malloc(size_t size)
+{
+    return alloc_block(size, __builtin_return_address(0));
+}
+
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
 {
     /* Reference: Malloc tutorial
      * https://danluu.com/malloc-tutorial/
      */
-    size_t size = nelem * elsize;  // TODO: check for overflow
-    void *ptr = test_malloc(size);
+    if (elsize && nelem > SIZE_MAX / elsize) {
+        report_event(MSG_WARN, "Calloc size overflows, returning NULL");
+        return NULL;
+    }
+    size_t size = nelem * elsize;
+    void *ptr = alloc_block(size, __builtin_return_address(0));
+    if (!ptr)
+        return NULL;
     memset(ptr, 0, size);
     return ptr;
 }
@@ -187,29 +499,39 @@ void test_free(void *p)
                      p);
         error_occurred = true;
     }
+    defer_exceptions();
     b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
     memset(p, FILLCHAR, b->payload_size);
+    site_free(b->site, b->payload_size);
+    if (b->account) {
+        atomic_fetch_sub(&b->account->bytes, b->payload_size);
+        atomic_fetch_sub(&b->account->blocks, 1);
+    }
 
-    /* Unlink from list */
+    /* Unlink from list of the thread that allocated it */
+    thread_cache_t *cache = b->owner;
+    pthread_mutex_lock(&cache->lock);
     block_element_t *bn = b->next;
     block_element_t *bp = b->prev;
     if (bp)
         bp->next = bn;
     else
-        allocated = bn;
+        cache->allocated = bn;
     if (bn)
         bn->prev = bp;
+    cache->allocated_count--;
+    pthread_mutex_unlock(&cache->lock);
 
     free(b);
-    allocated_count--;
+    allow_exceptions();
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc_block(len, __builtin_return_address(0));
     if (!new)
         return NULL;
 
@@ -218,11 +540,213 @@ char *test_strdup(const char *s)
 
 size_t allocation_check()
 {
-    return allocated_count;
+    size_t count = 0;
+    lock_blocks(&cache_list_lock);
+    for (thread_cache_t *cache = cache_list; cache; cache = cache->next) {
+        pthread_mutex_lock(&cache->lock);
+        count += cache->allocated_count;
+        pthread_mutex_unlock(&cache->lock);
+    }
+    unlock_blocks(&cache_list_lock);
+    return count;
+}
+
+void allocation_totals(size_t *allocs, size_t *bytes)
+{
+    *allocs = *bytes = 0;
+    lock_blocks(&cache_list_lock);
+    for (thread_cache_t *cache = cache_list; cache; cache = cache->next) {
+        pthread_mutex_lock(&cache->lock);
+        *allocs += cache->total_allocs;
+        *bytes += cache->total_bytes;
+        pthread_mutex_unlock(&cache->lock);
+    }
+    unlock_blocks(&cache_list_lock);
+}
+
+/* Format call site as module+offset, which can be fed to addr2line, and
+ * add the nearest exported symbol when there is one.
+ */
+static void format_site(void *site, char *buf, size_t len)
+{
+    Dl_info info;
+    if (!site) {
+        snprintf(buf, len, "(other sites)");
+    } else if (dladdr(site, &info) && info.dli_fname) {
+        const char *module = strrchr(info.dli_fname, '/');
+        module = module ? module + 1 : info.dli_fname;
+        if (info.dli_sname)
+            snprintf(buf, len, "%s+%#lx (%s+%#lx)", module,
+                     (unsigned long) ((uintptr_t) site -
+                                      (uintptr_t) info.dli_fbase),
+                     info.dli_sname,
+                     (unsigned long) ((uintptr_t) site -
+                                      (uintptr_t) info.dli_saddr));
+        else
+            snprintf(buf, len, "%s+%#lx", module,
+                     (unsigned long) ((uintptr_t) site -
+                                      (uintptr_t) info.dli_fbase));
+    } else {
+        snprintf(buf, len, "%p", site);
+    }
+}
+
+typedef struct {
+    void *site;
+    size_t allocs, bytes, live_blocks, live_bytes;
+} site_snapshot_t;
+
+static int cmp_site_bytes(const void *a, const void *b)
+{
+    const site_snapshot_t *sa = a, *sb = b;
+    if (sa->bytes != sb->bytes)
+        return sa->bytes < sb->bytes ? 1 : -1;
+    return (sa->allocs < sb->allocs) - (sa->allocs > sb->allocs);
+}
+
+static int cmp_site_live(const void *a, const void *b)
+{
+    const site_snapshot_t *sa = a, *sb = b;
+    if (sa->live_bytes != sb->live_bytes)
+        return sa->live_bytes < sb->live_bytes ? 1 : -1;
+    return (sa->live_blocks < sb->live_blocks) -
+           (sa->live_blocks > sb->live_blocks);
+}
+
+void heap_profile_report(int top, bool leaks_only)
+{
+    site_snapshot_t *snap =
+        malloc((SITE_TABLE_SIZE + 1) * sizeof(site_snapshot_t));
+    if (!snap) {
+        report(1, "Couldn't allocate space for heap profile");
+        return;
+    }
+
+    int n = 0;
+    for (int i = 0; i <= SITE_TABLE_SIZE; i++) {
+        alloc_site_t *entry = &site_table[i];
+        site_snapshot_t *s = &snap[n];
+        s->site = atomic_load(&entry->site);
+        s->allocs = atomic_load(&entry->allocs);
+        s->bytes = atomic_load(&entry->bytes);
+        s->live_blocks = atomic_load(&entry->live_blocks);
+        s->live_bytes = atomic_load(&entry->live_bytes);
+        if (s->allocs && (!leaks_only || s->live_blocks))
+            n++;
+    }
+    qsort(snap, n, sizeof(site_snapshot_t),
+          leaks_only ? cmp_site_live : cmp_site_bytes);
+
+    if (top <= 0 || top > n)
+        top = n;
+    report(1, "%12s %14s %12s %14s  %s", "allocs", "bytes", "live",
+           "live bytes", "site");
+    for (int i = 0; i < top; i++) {
+        char name[256];
+        format_site(snap[i].site, name, sizeof(name));
+        report(1, "%12lu %14lu %12lu %14lu  %s", snap[i].allocs, snap[i].bytes,
+               snap[i].live_blocks, snap[i].live_bytes, name);
+    }
+    if (top < n)
+        report(1, "... %d more sites", n - top);
+
+    free(snap);
+}
+
+void heap_profile_reset()
+{
+    for (int i = 0; i <= SITE_TABLE_SIZE; i++) {
+        alloc_site_t *entry = &site_table[i];
+        /* Live counts must survive, as blocks still point to the entry */
+        atomic_store(&entry->allocs, atomic_load(&entry->live_blocks));
+        atomic_store(&entry->bytes, atomic_load(&entry->live_bytes));
+    }
 }
 
 /* Implementation of functions for testing */
 
+static void update_fault_armed()
+{
+    bool any = fail_probability > 0 || fail_nth > 0 || fail_every > 0 ||
+               fail_size > 0;
+    fault_armed = any && fault_cmd_active;
+}
+
+/* Restart failure schedule after any of its parameters changed */
+void fault_reset()
+{
+    if (fail_probability <= 0)
+        fault_threshold = 0;
+    else if (fail_probability >= 100)
+        fault_threshold = UINT32_MAX;
+    else
+        fault_threshold = (uint32_t) (fail_probability * (UINT32_MAX / 100));
+
+    fault_rng_seed = fail_seed ? (uint64_t) fail_seed : (uint64_t) random();
+    fault_rng_seed = fault_rng_seed * 0x2545F4914F6CDD1DULL + 1;
+    atomic_fetch_add(&fault_generation, 1);
+    atomic_store(&fault_count, 0);
+    update_fault_armed();
+}
+
+void fault_set_command(const char *name)
+{
+    free(fault_cmd);
+    fault_cmd = name ? strdup(name) : NULL;
+    fault_cmd_active = !fault_cmd;
+    update_fault_armed();
+}
+
+const char *fault_command()
+{
+    return fault_cmd;
+}
+
+void fault_enter_command(const char *name)
+{
+    if (!fault_cmd)
+        return;
+    fault_cmd_active = !strcmp(name, fault_cmd);
+    update_fault_armed();
+}
+
+unsigned long fault_allocations()
+{
+    return atomic_load(&fault_count);
+}
+
+void mem_account_set(mem_account_t *account)
+{
+    atomic_store(&cur_account, account);
+}
+
+void mem_account_move(mem_account_t *from, mem_account_t *to)
+{
+    if (from == to)
+        return;
+    if (atomic_load(&cur_account) == from)
+        atomic_store(&cur_account, to);
+
+    lock_blocks(&cache_list_lock);
+    for (thread_cache_t *cache = cache_list; cache; cache = cache->next) {
+        pthread_mutex_lock(&cache->lock);
+        for (block_element_t *b = cache->allocated; b; b = b->next) {
+            if (b->account != from)
+                continue;
+            b->account = to;
+            if (to) {
+                atomic_fetch_add(&to->bytes, b->payload_size);
+                atomic_fetch_add(&to->blocks, 1);
+            }
+        }
+        pthread_mutex_unlock(&cache->lock);
+    }
+    unlock_blocks(&cache_list_lock);
+
+    atomic_store(&from->bytes, 0);
+    atomic_store(&from->blocks, 0);
+}
+
 /* Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
@@ -242,35 +766,122 @@ void set_noallocate_mode(bool noallocate)
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return atomic_exchange(&error_occurred, false);
 }
 
-/* Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
- */
-bool exception_setup(bool limit_time)
-{
-    if (sigsetjmp(env, 1)) {
-        /* Got here from longjmp */
-        jmp_ready = false;
-        if (time_limited) {
-            alarm(0);
-            time_limited = false;
+void budget_set(const char *name, int budget)
+{
+    budget_element_t *b = budget_list;
+    budget_element_t **last_loc = &budget_list;
+    while (b && strcmp(name, b->name) > 0) {
+        last_loc = &b->next;
+        b = b->next;
+    }
+
+    if (b && !strcmp(name, b->name)) {
+        if (budget >= 0) {
+            b->budget = budget;
+        } else {
+            /* Back to default budget */
+            *last_loc = b->next;
+            free(b->name);
+            free(b);
+        }
+        return;
+    }
+    if (budget < 0)
+        return;
+
+    budget_element_t *nb = malloc(sizeof(budget_element_t));
+    if (!nb || !(nb->name = strdup(name))) {
+        free(nb);
+        report_event(MSG_FATAL, "Couldn't allocate time budget");
+        return;
+    }
+    nb->budget = budget;
+    nb->next = b;
+    *last_loc = nb;
+}
+
+void budget_show()
+{
+    report(1, "Default budget: %d ms", time_budget);
+    for (budget_element_t *b = budget_list; b; b = b->next)
+        report(1, "  %-12s%d ms", b->name, b->budget);
+}
+
+void budget_enter_command(const char *name)
+{
+    cmd_budget = -1;
+    for (budget_element_t *b = budget_list; b; b = b->next) {
+        if (!strcmp(name, b->name)) {
+            cmd_budget = b->budget;
+            break;
         }
+    }
+}
+
+/* Arm interval timer to raise SIGALRM after budget milliseconds.
+ * A budget of 0 disarms it.
+ */
+static void set_timer(int budget)
+{
+    struct itimerval it = {
+        .it_interval = {0, 0},
+        .it_value = {budget / 1000, (budget % 1000) * 1000},
+    };
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+/* Milliseconds since guarded operation started */
+static double guard_elapsed()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - exc.start.tv_sec) * 1e3 +
+           (now.tv_nsec - exc.start.tv_nsec) * 1e-6;
+}
+
+static void report_guard_time()
+{
+    if (exc.time_limited)
+        report(1, "Guarded operation took %.3f ms (budget %d ms)",
+               guard_elapsed(), exc.budget);
+    else
+        report(1, "Guarded operation took %.3f ms", guard_elapsed());
+}
+
+sigjmp_buf *exception_env()
+{
+    return &exc.env;
+}
 
-        if (error_message)
-            report_event(MSG_ERROR, error_message);
-        error_message = "";
-        return false;
+/* Got here from longjmp */
+bool exception_caught()
+{
+    exc.jmp_ready = false;
+    if (exc.error_message)
+        report_event(MSG_ERROR, exc.error_message);
+    exc.error_message = "";
+
+    if (show_guard_time)
+        report_guard_time();
+    if (exc.time_limited) {
+        set_timer(0);
+        exc.time_limited = false;
     }
+    return false;
+}
 
-    /* Got here from initial call */
-    jmp_ready = true;
-    if (limit_time) {
-        alarm(time_limit);
-        time_limited = true;
+/* Got here from initial call */
+bool exception_armed(bool limit_time)
+{
+    exc.jmp_ready = true;
+    exc.budget = cmd_budget >= 0 ? cmd_budget : time_budget;
+    clock_gettime(CLOCK_MONOTONIC, &exc.start);
+    if (limit_time && exc.budget > 0) {
+        set_timer(exc.budget);
+        exc.time_limited = true;
     }
     return true;
 }
@@ -278,22 +889,29 @@ bool exception_setup(bool limit_time)
 /* Call once past risky code */
 void exception_cancel()
 {
-    if (time_limited) {
-        alarm(0);
-        time_limited = false;
+    if (exc.jmp_ready && show_guard_time)
+        report_guard_time();
+
+    if (exc.time_limited) {
+        set_timer(0);
+        exc.time_limited = false;
     }
 
-    jmp_ready = false;
-    error_message = "";
+    exc.jmp_ready = false;
+    exc.error_message = "";
 }
 
 /* Use longjmp to return to most recent exception setup */
 void trigger_exception(char *msg)
 {
     error_occurred = true;
-    error_message = msg;
-    if (jmp_ready)
-        siglongjmp(env, 1);
+    exc.error_message = msg;
+    if (exc.deferred) {
+        exc.pending = true;
+        return;
+    }
+    if (exc.jmp_ready)
+        siglongjmp(exc.env, 1);
     else
         exit(1);
 }
@@ -3,11 +3,16 @@
 
 #include <setjmp.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 
 /* This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
  * allow checking for common allocation errors.
+ *
+ * The harness is thread-aware: blocks are tracked in per-thread lists and
+ * every thread has its own exception context, so multi-threaded queue code
+ * can be tested as well.
  */
 
 void *test_malloc(size_t size);
@@ -18,12 +23,67 @@ char *test_strdup(const char *s);
 
 #ifdef INTERNAL
 
-/* Report number of allocated blocks */
+/* Report number of allocated blocks, summed over all threads */
 size_t allocation_check();
 
+/* Report number of allocations and bytes ever allocated by all threads */
+void allocation_totals(size_t *allocs, size_t *bytes);
+
+/* Print per-call-site allocation statistics, ordered by bytes allocated.
+ * With leaks_only, list only sites that still have live blocks, ordered by
+ * live bytes.  Show at most top sites (top <= 0 shows all).
+ */
+void heap_profile_report(int top, bool leaks_only);
+
+/* Clear allocation totals of all call sites, keeping live block counts */
+void heap_profile_reset();
+
+/* Bytes and blocks allocated on behalf of one queue */
+typedef struct {
+    atomic_size_t bytes;
+    atomic_size_t blocks;
+} mem_account_t;
+
+/* Memory quota of each queue in bytes (0 = unlimited).
+ * Allocations charged to an account that would exceed it return NULL.
+ */
+extern int mem_quota;
+
+/* Charge subsequent allocations of all threads to account (NULL = none) */
+void mem_account_set(mem_account_t *account);
+
+/* Charge all blocks of account from to account to instead (NULL = none).
+ * Must be called before from is released.
+ */
+void mem_account_move(mem_account_t *from, mem_account_t *to);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Deterministic failure schedule, 0 disables a rule:
+ * fail the nth allocation, every kth allocation, or allocations larger than
+ * fail_size bytes.  fail_seed fixes the stream used for fail_probability.
+ */
+extern int fail_nth;
+extern int fail_every;
+extern int fail_size;
+extern int fail_seed;
+
+/* Restart the failure schedule.  Call after changing any parameter above */
+void fault_reset();
+
+/* Restrict fault injection to command name (NULL = all commands) */
+void fault_set_command(const char *name);
+
+/* Command fault injection is restricted to, or NULL */
+const char *fault_command();
+
+/* Notify harness that command name is about to run */
+void fault_enter_command(const char *name);
+
+/* Number of allocations checked since the schedule was last restarted */
+unsigned long fault_allocations();
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -39,15 +99,46 @@ void set_noallocate_mode(bool noallocate);
 /* Return whether any errors have occurred since last time checked */
 bool error_check();
 
-/* Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
+/* Time budget of a guarded operation, in milliseconds (0 = unlimited) */
+extern int time_budget;
+
+/* Report time used by every guarded operation */
+extern int show_guard_time;
+
+/* Set time budget in milliseconds of command name, overriding time_budget.
+ * A negative budget restores the default.
+ */
+void budget_set(const char *name, int budget);
+
+/* Print default budget and budgets of individual commands */
+void budget_show();
+
+/* Notify harness that command name is about to run */
+void budget_enter_command(const char *name);
+
+/* Prepare for a risky operation using sigsetjmp.
+ * The exception context belongs to the calling thread.
+ * With limit_time, the operation is interrupted by SIGALRM once it exceeds
+ * the time budget of the running command.
+ * Returns true for initial return, false for error return.  It is a macro
+ * so that sigsetjmp saves the frame of its caller, which is still live
+ * when the exception is taken.
  */
-bool exception_setup(bool limit_time);
+#define exception_setup(limit_time)                                 \
+    (sigsetjmp(*exception_env(), 1) ? exception_caught()            \
+                                     : exception_armed(limit_time))
+
+/* Parts of exception_setup */
+sigjmp_buf *exception_env();
+bool exception_caught();
+bool exception_armed(bool limit_time);
 
 /* Call once past risky code */
 void exception_cancel();
 
-/* Use longjmp to return to most recent exception setup.  Include error message
+/* Use longjmp to return to most recent exception setup of calling thread.
+ * Include error message.  While the harness is allocating or freeing a
+ * block, the jump waits until it is done.
  */
 void trigger_exception(char *msg);
 
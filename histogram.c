@@ -0,0 +1,81 @@
+#include <string.h>
+
+#include "histogram.h"
+
+/* Map value to bucket index */
+static inline unsigned bucket_of(uint64_t value)
+{
+    if (value < HIST_SUB_BUCKETS)
+        return value;
+
+    /* Position of the highest bit selects the power of two, the next
+     * HIST_SUB_BITS bits select the linear bucket within it.
+     */
+    unsigned exp = 63 - __builtin_clzll(value);
+    unsigned sub = (value >> (exp - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+/* Largest value that maps to bucket index */
+static uint64_t bucket_upper(unsigned index)
+{
+    if (index < HIST_SUB_BUCKETS)
+        return index;
+
+    unsigned exp = index / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    uint64_t sub = index % HIST_SUB_BUCKETS;
+    uint64_t lower = (1ULL << exp) | (sub << (exp - HIST_SUB_BITS));
+    return lower + (1ULL << (exp - HIST_SUB_BITS)) - 1;
+}
+
+void hist_reset(histogram_t *h)
+{
+    memset(h, 0, sizeof(histogram_t));
+    h->min = UINT64_MAX;
+}
+
+void hist_record(histogram_t *h, uint64_t value)
+{
+    h->count++;
+    h->sum += value;
+    if (value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->buckets[bucket_of(value)]++;
+}
+
+uint64_t hist_percentile(const histogram_t *h, double pct)
+{
+    if (!h->count)
+        return 0;
+    if (pct <= 0)
+        return h->min;
+    if (pct >= 100)
+        return h->max;
+
+    /* Rank of the wanted value, counting from 1 */
+    uint64_t rank = (uint64_t) (pct / 100 * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t v = bucket_upper(i);
+            /* Bucket bounds may lie outside the recorded range */
+            if (v > h->max)
+                v = h->max;
+            if (v < h->min)
+                v = h->min;
+            return v;
+        }
+    }
+    return h->max;
+}
+
+double hist_mean(const histogram_t *h)
+{
+    return h->count ? (double) h->sum / h->count : 0;
+}
@@ -0,0 +1,41 @@
+#ifndef LAB0_HISTOGRAM_H
+#define LAB0_HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Log-linear histogram in the style of HdrHistogram.
+ *
+ * Values below HIST_SUB_BUCKETS are counted exactly.  Above that, every
+ * power of two is split into HIST_SUB_BUCKETS linear buckets, so any
+ * recorded value is known to within 1/HIST_SUB_BUCKETS (about 6%), while
+ * the whole 64-bit range fits in a fixed array.
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} histogram_t;
+
+/* Clear all recorded values */
+void hist_reset(histogram_t *h);
+
+/* Record one value */
+void hist_record(histogram_t *h, uint64_t value);
+
+/* Value below which pct percent of the recorded values fall.
+ * Exact for the minimum and maximum, otherwise the upper bound of the
+ * bucket holding the percentile.
+ */
+uint64_t hist_percentile(const histogram_t *h, double pct);
+
+/* Mean of recorded values */
+double hist_mean(const histogram_t *h);
+
+#endif /* LAB0_HISTOGRAM_H */
@@ -0,0 +1,167 @@
+/* Hardware performance counters */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "perf.h"
+#include "report.h"
+
+static const char *perf_names[PERF_NCOUNTERS] = {
+    [PERF_CYCLES] = "cycles",
+    [PERF_INSTRUCTIONS] = "instructions",
+    [PERF_L1D_MISSES] = "L1D-misses",
+    [PERF_LLC_MISSES] = "LLC-misses",
+    [PERF_BRANCH_MISSES] = "branch-misses",
+    [PERF_DTLB_MISSES] = "dTLB-misses",
+};
+
+#ifdef __linux__
+
+#define CACHE_MISS(cache)                           \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} perf_events[PERF_NCOUNTERS] = {
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_L1D_MISSES] = {PERF_TYPE_HW_CACHE,
+                         CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    [PERF_LLC_MISSES] = {PERF_TYPE_HW_CACHE,
+                         CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+    [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [PERF_DTLB_MISSES] = {PERF_TYPE_HW_CACHE,
+                          CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+};
+
+static int perf_fd[PERF_NCOUNTERS] = {-1, -1, -1, -1, -1, -1};
+static int perf_opened = 0;
+
+static int open_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    /* User space only, which is all an unprivileged process may count */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int perf_open()
+{
+    if (perf_opened)
+        return perf_opened;
+    for (int i = 0; i < PERF_NCOUNTERS; i++) {
+        perf_fd[i] = open_counter(perf_events[i].type, perf_events[i].config);
+        if (perf_fd[i] >= 0)
+            perf_opened++;
+    }
+    return perf_opened;
+}
+
+void perf_close()
+{
+    for (int i = 0; i < PERF_NCOUNTERS; i++) {
+        if (perf_fd[i] >= 0)
+            close(perf_fd[i]);
+        perf_fd[i] = -1;
+    }
+    perf_opened = 0;
+}
+
+bool perf_read(perf_sample_t *sample)
+{
+    if (!perf_opened)
+        return false;
+    for (int i = 0; i < PERF_NCOUNTERS; i++) {
+        uint64_t buf[3] = {0, 0, 0};
+        if (perf_fd[i] >= 0 && read(perf_fd[i], buf, sizeof(buf)) < 0)
+            memset(buf, 0, sizeof(buf));
+        sample->value[i] = buf[0];
+        sample->enabled[i] = buf[1];
+        sample->running[i] = buf[2];
+    }
+    return true;
+}
+
+void perf_delta(const perf_sample_t *start,
+                const perf_sample_t *end,
+                perf_counts_t *counts)
+{
+    for (int i = 0; i < PERF_NCOUNTERS; i++) {
+        uint64_t running = end->running[i] - start->running[i];
+        uint64_t enabled = end->enabled[i] - start->enabled[i];
+        uint64_t value = end->value[i] - start->value[i];
+        if (perf_fd[i] < 0 || !running)
+            counts->count[i] = -1;
+        else if (running == enabled)
+            counts->count[i] = value;
+        else
+            counts->count[i] = (double) value * enabled / running;
+    }
+}
+
+#else /* !__linux__ */
+
+/* No perf_event_open, so there is never a counter to read */
+
+int perf_open()
+{
+    report(1, "Performance counters are unavailable on this platform");
+    return 0;
+}
+
+void perf_close()
+{
+}
+
+bool perf_read(perf_sample_t *sample)
+{
+    return false;
+}
+
+void perf_delta(const perf_sample_t *start,
+                const perf_sample_t *end,
+                perf_counts_t *counts)
+{
+    for (int i = 0; i < PERF_NCOUNTERS; i++)
+        counts->count[i] = -1;
+}
+
+#endif /* __linux__ */
+
+void perf_report(int level, const perf_counts_t *counts)
+{
+    char buf[256];
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < PERF_NCOUNTERS && len < sizeof(buf); i++) {
+        if (counts->count[i] < 0)
+            continue;
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%s = %" PRId64,
+                        len ? ", " : "", perf_names[i],
+                        counts->count[i]);
+    }
+
+    int64_t cycles = counts->count[PERF_CYCLES];
+    int64_t insns = counts->count[PERF_INSTRUCTIONS];
+    if (cycles > 0 && insns >= 0 && len < sizeof(buf))
+        snprintf(buf + len, sizeof(buf) - len, " (IPC %.2f)",
+                 (double) insns / cycles);
+
+    report(level, "%s", len ? buf : "No counters ran");
+}
@@ -0,0 +1,56 @@
+#ifndef LAB0_PERF_H
+#define LAB0_PERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hardware performance counters of this process, via perf_event_open.
+ *
+ * Counters run freely once opened.  A command is measured by reading them
+ * before and after it and taking the difference, so measurements of nested
+ * commands do not disturb each other.
+ */
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_NCOUNTERS
+};
+
+/* Raw readings of every counter */
+typedef struct {
+    uint64_t value[PERF_NCOUNTERS];
+    uint64_t enabled[PERF_NCOUNTERS];
+    uint64_t running[PERF_NCOUNTERS];
+} perf_sample_t;
+
+/* Events counted between two samples, scaled up if the kernel had to share
+ * a counter with other events.  Counters that could not be opened or never
+ * ran are -1.
+ */
+typedef struct {
+    int64_t count[PERF_NCOUNTERS];
+} perf_counts_t;
+
+/* Open as many counters as possible.  Return number opened */
+int perf_open();
+
+/* Close all counters */
+void perf_close();
+
+/* Read all counters.  Return false if none are open */
+bool perf_read(perf_sample_t *sample);
+
+/* Compute events counted from start to end */
+void perf_delta(const perf_sample_t *start,
+                const perf_sample_t *end,
+                perf_counts_t *counts);
+
+/* Print counts on one line */
+void perf_report(int level, const perf_counts_t *counts);
+
+#endif /* LAB0_PERF_H */
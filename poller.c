@@ -0,0 +1,237 @@
+/* Readiness of file descriptors, by epoll on Linux and poll() elsewhere */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "poller.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+
+#define POLLER_BATCH 64 /* most events taken from kernel by one wait */
+
+struct poller {
+    int epoll_fd;
+};
+
+poller_t *poller_new()
+{
+    poller_t *p = malloc(sizeof(poller_t));
+    if (!p)
+        return NULL;
+    p->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (p->epoll_fd < 0) {
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+void poller_free(poller_t *p)
+{
+    if (!p)
+        return;
+    close(p->epoll_fd);
+    free(p);
+}
+
+bool poller_add(poller_t *p, int fd, uint32_t events, void *tag)
+{
+    struct epoll_event ev = {.events = events, .data.ptr = tag};
+    return epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+bool poller_mod(poller_t *p, int fd, uint32_t events, void *tag)
+{
+    struct epoll_event ev = {.events = events, .data.ptr = tag};
+    return epoll_ctl(p->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void poller_del(poller_t *p, int fd)
+{
+    epoll_ctl(p->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int poller_wait(poller_t *p, poller_event_t *events, int max, int timeout)
+{
+    struct epoll_event ev[POLLER_BATCH];
+    if (max > POLLER_BATCH)
+        max = POLLER_BATCH;
+    int n = epoll_wait(p->epoll_fd, ev, max, timeout);
+    for (int i = 0; i < n; i++) {
+        events[i].events = ev[i].events;
+        events[i].tag = ev[i].data.ptr;
+    }
+    return n;
+}
+
+bool wakeup_open(int fds[2])
+{
+    fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return fds[0] >= 0;
+}
+
+void wakeup_close(int fds[2])
+{
+    if (fds[0] >= 0)
+        close(fds[0]);
+    fds[0] = fds[1] = -1;
+}
+
+void wakeup_signal(int fds[2])
+{
+    uint64_t one = 1;
+    while (write(fds[1], &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+void wakeup_clear(int fds[2])
+{
+    uint64_t count;
+    while (read(fds[0], &count, sizeof(count)) < 0 && errno == EINTR)
+        ;
+}
+
+#else /* !__linux__ */
+
+struct poller {
+    struct pollfd *fds;
+    void **tags;
+    int count, size;
+    int next; /* First to report, so that later ones are not starved */
+};
+
+poller_t *poller_new()
+{
+    return calloc(1, sizeof(poller_t));
+}
+
+void poller_free(poller_t *p)
+{
+    if (!p)
+        return;
+    free(p->fds);
+    free(p->tags);
+    free(p);
+}
+
+static int find(poller_t *p, int fd)
+{
+    for (int i = 0; i < p->count; i++) {
+        if (p->fds[i].fd == fd)
+            return i;
+    }
+    return -1;
+}
+
+bool poller_add(poller_t *p, int fd, uint32_t events, void *tag)
+{
+    if (find(p, fd) >= 0) {
+        errno = EEXIST;
+        return false;
+    }
+    if (p->count == p->size) {
+        int size = p->size ? 2 * p->size : 16;
+        struct pollfd *fds = realloc(p->fds, size * sizeof(struct pollfd));
+        if (!fds)
+            return false;
+        p->fds = fds;
+        void **tags = realloc(p->tags, size * sizeof(void *));
+        if (!tags)
+            return false;
+        p->tags = tags;
+        p->size = size;
+    }
+    p->fds[p->count] = (struct pollfd){.fd = fd, .events = events};
+    p->tags[p->count++] = tag;
+    return true;
+}
+
+bool poller_mod(poller_t *p, int fd, uint32_t events, void *tag)
+{
+    int i = find(p, fd);
+    if (i < 0) {
+        errno = ENOENT;
+        return false;
+    }
+    p->fds[i].events = events;
+    p->tags[i] = tag;
+    return true;
+}
+
+void poller_del(poller_t *p, int fd)
+{
+    int i = find(p, fd);
+    if (i < 0)
+        return;
+    p->count--;
+    p->fds[i] = p->fds[p->count];
+    p->tags[i] = p->tags[p->count];
+}
+
+int poller_wait(poller_t *p, poller_event_t *events, int max, int timeout)
+{
+    int ready = poll(p->fds, p->count, timeout);
+    if (ready <= 0)
+        return ready;
+
+    int n = 0;
+    for (int k = 0; k < p->count && n < max; k++) {
+        int i = (p->next + k) % p->count;
+        if (!p->fds[i].revents)
+            continue;
+        events[n].events = p->fds[i].revents;
+        events[n++].tag = p->tags[i];
+    }
+    p->next = (p->next + 1) % p->count;
+    return n;
+}
+
+static bool set_flags(int fd)
+{
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0 &&
+           fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+bool wakeup_open(int fds[2])
+{
+    if (pipe(fds) < 0) {
+        fds[0] = fds[1] = -1;
+        return false;
+    }
+    if (!set_flags(fds[0]) || !set_flags(fds[1])) {
+        wakeup_close(fds);
+        return false;
+    }
+    return true;
+}
+
+void wakeup_close(int fds[2])
+{
+    if (fds[0] >= 0)
+        close(fds[0]);
+    if (fds[1] >= 0)
+        close(fds[1]);
+    fds[0] = fds[1] = -1;
+}
+
+void wakeup_signal(int fds[2])
+{
+    /* A full pipe is readable already */
+    char one = 1;
+    while (write(fds[1], &one, 1) < 0 && errno == EINTR)
+        ;
+}
+
+void wakeup_clear(int fds[2])
+{
+    char buf[64];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0 ||
+           (n < 0 && errno == EINTR))
+        ;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,63 @@
+#ifndef LAB0_POLLER_H
+#define LAB0_POLLER_H
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Readiness of many file descriptors, each registered with a tag that is
+ * handed back with its events.  Linux keeps the set in the kernel with
+ * epoll; elsewhere each wait is one poll() over the whole set.  Events are
+ * POLLIN, POLLOUT, POLLHUP and POLLERR, whose values epoll shares.
+ *
+ * A poller is only used by the thread owning it.
+ */
+
+/* Wake only one of the pollers waiting on a descriptor.  Where that is not
+ * supported every one wakes, and all but one find nothing to do.
+ */
+#ifdef __linux__
+#include <sys/epoll.h>
+#define POLLER_EXCLUSIVE EPOLLEXCLUSIVE
+#else
+#define POLLER_EXCLUSIVE 0
+#endif
+
+typedef struct poller poller_t;
+
+typedef struct {
+    uint32_t events;
+    void *tag;
+} poller_event_t;
+
+/* Return NULL with errno set on failure */
+poller_t *poller_new();
+
+void poller_free(poller_t *p);
+
+bool poller_add(poller_t *p, int fd, uint32_t events, void *tag);
+
+/* Replace events wanted from fd, and its tag */
+bool poller_mod(poller_t *p, int fd, uint32_t events, void *tag);
+
+void poller_del(poller_t *p, int fd);
+
+/* Wait up to timeout milliseconds, or without limit if timeout is -1.
+ * Return number of events stored, 0 on timeout, or -1 with errno set.
+ */
+int poller_wait(poller_t *p, poller_event_t *events, int max, int timeout);
+
+/* Descriptors for waking a poller from another thread: fds[0] turns
+ * readable once fds[1] is signalled, until cleared.  Both are one eventfd
+ * on Linux, and the ends of a pipe elsewhere.  Return false if they could
+ * not be opened, leaving both -1.
+ */
+bool wakeup_open(int fds[2]);
+
+void wakeup_close(int fds[2]);
+
+void wakeup_signal(int fds[2]);
+
+void wakeup_clear(int fds[2]);
+
+#endif /* LAB0_POLLER_H */
@@ -3,12 +3,15 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h> /* strcasecmp */
+#include <sys/mman.h> /* shm_unlink */
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -19,6 +22,7 @@
 #include <time.h>
 #endif
 
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 #include "list.h"
 #include "random.h"
@@ -46,6 +50,8 @@ extern int show_entropy;
 
 #include "console.h"
 #include "report.h"
+#include "shmring.h"
+#include "wsdeque.h"
 
 /* Settable parameters */
 
@@ -67,6 +73,14 @@ typedef struct {
 static queue_chain_t chain = {.size = 0};
 static queue_contex_t *current = NULL;
 
+/* Bookkeeping that qtest keeps alongside each queue context */
+typedef struct {
+    queue_contex_t ctx;
+    mem_account_t mem;
+} queue_info_t;
+
+#define queue_info(qctx) container_of(qctx, queue_info_t, ctx)
+
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST_SIZE;
 static int fail_count = 0;
@@ -120,7 +134,8 @@ static bool do_free(int argc, char *argv[])
     }
 
     if (current) {
-        free(current);
+        mem_account_move(&queue_info(current)->mem, NULL);
+        free(queue_info(current));
         chain.size--;
         current = qnext ? list_entry(qnext, queue_contex_t, chain) : NULL;
     }
@@ -148,9 +163,14 @@ static bool do_new(int argc, char *argv[])
     bool ok = true;
 
     if (exception_setup(true)) {
-        queue_contex_t *qctx = malloc(sizeof(queue_contex_t));
+        queue_info_t *info = malloc(sizeof(queue_info_t));
+        queue_contex_t *qctx = &info->ctx;
         list_add_tail(&qctx->chain, &chain.head);
 
+        atomic_init(&info->mem.bytes, 0);
+        atomic_init(&info->mem.blocks, 0);
+        mem_account_set(&info->mem);
+
         qctx->size = 0;
         qctx->q = q_new();
         qctx->id = chain.size++;
@@ -834,7 +854,9 @@ static bool do_merge(int argc, char *argv[])
             queue_contex_t *ctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
             q_free(ctx->q);
-            free(ctx);
+            /* Elements now live in the merged queue */
+            mem_account_move(&queue_info(ctx)->mem, &queue_info(current)->mem);
+            free(queue_info(ctx));
         }
 
         chain.head.prev = &current->chain;
@@ -1012,6 +1034,526 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+static bool do_heapprof(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    int top = 10;
+    if (argc == 2) {
+        if (!strcmp(argv[1], "reset")) {
+            heap_profile_reset();
+            return true;
+        }
+        if (!strcmp(argv[1], "leaks")) {
+            heap_profile_report(0, true);
+            return true;
+        }
+        if (!get_int(argv[1], &top)) {
+            report(1, "Invalid number of sites '%s'", argv[1]);
+            return false;
+        }
+    }
+
+    heap_profile_report(top, false);
+    return true;
+}
+
+static void mem_hook(int argc, char *argv[])
+{
+    mem_account_set(current ? &queue_info(current)->mem : NULL);
+}
+
+static bool do_mem(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!chain.size) {
+        report(1, "There is no queue");
+        return true;
+    }
+
+    report(1, "%4s %10s %12s %10s %12s %10s", "ID", "nodes", "bytes", "blocks",
+           "bytes/node", "overhead");
+    queue_contex_t *qctx;
+    list_for_each_entry (qctx, &chain.head, chain) {
+        mem_account_t *mem = &queue_info(qctx)->mem;
+        size_t bytes = atomic_load(&mem->bytes);
+        size_t blocks = atomic_load(&mem->blocks);
+
+        /* Payload is the string data, everything else is overhead */
+        size_t payload = 0;
+        if (qctx->q && exception_setup(true)) {
+            element_t *e;
+            int cnt = 0;
+            list_for_each_entry (e, qctx->q, list) {
+                if (cnt++ >= qctx->size)
+                    break;
+                payload += strlen(e->value) + 1;
+            }
+        }
+        exception_cancel();
+
+        double per_node = qctx->size ? (double) bytes / qctx->size : 0;
+        double overhead = payload ? (double) bytes / payload : 0;
+        report(1, "%4d %10d %12zu %10zu %12.1f %9.2fx%s", qctx->id, qctx->size,
+               bytes, blocks, per_node, overhead,
+               qctx == current ? "  (current)" : "");
+    }
+
+    if (mem_quota > 0)
+        report(1, "Quota: %d bytes per queue", mem_quota);
+    return !error_check();
+}
+
+static void fault_changed(int oldval)
+{
+    fault_reset();
+}
+
+static void fault_hook(int argc, char *argv[])
+{
+    fault_enter_command(argv[0]);
+}
+
+static void budget_hook(int argc, char *argv[])
+{
+    budget_enter_command(argv[0]);
+}
+
+static bool do_budget(int argc, char *argv[])
+{
+    if (argc == 1) {
+        budget_show();
+        return true;
+    }
+
+    if (argc != 3) {
+        report(1, "%s takes 0 or 2 arguments", argv[0]);
+        return false;
+    }
+
+    int budget;
+    if (!get_int(argv[2], &budget)) {
+        report(1, "Invalid time budget '%s'", argv[2]);
+        return false;
+    }
+
+    budget_set(argv[1], budget);
+    return true;
+}
+
+static bool do_fault(int argc, char *argv[])
+{
+    if (argc == 2 && !strcmp(argv[1], "off")) {
+        fail_probability = fail_nth = fail_every = fail_size = 0;
+        fault_set_command(NULL);
+        fault_reset();
+        return true;
+    }
+
+    if (argc == 3 && !strcmp(argv[1], "cmd")) {
+        fault_set_command(strcmp(argv[2], "any") ? argv[2] : NULL);
+        fault_reset();
+        return true;
+    }
+
+    if (argc != 1) {
+        report(1, "%s takes no arguments, 'off' or 'cmd name'", argv[0]);
+        return false;
+    }
+
+    const char *cmd = fault_command();
+    report(1, "Fault injection: nth = %d, every = %d, size > %d, "
+              "probability = %d%%, seed = %d, command = %s",
+           fail_nth, fail_every, fail_size, fail_probability, fail_seed,
+           cmd ? cmd : "any");
+    report(1, "%lu allocations since schedule was set", fault_allocations());
+    return true;
+}
+
+/* Contents of current queue, restored before each run of bench */
+typedef struct {
+    char **values;
+    int size;
+} snapshot_t;
+
+static void snapshot_free(snapshot_t *snap)
+{
+    for (int i = 0; i < snap->size; i++)
+        free(snap->values[i]);
+    free(snap->values);
+}
+
+static bool snapshot_take(snapshot_t *snap)
+{
+    snap->size = 0;
+    snap->values = malloc(sizeof(char *) * (current->size + 1));
+    if (!snap->values)
+        return false;
+
+    bool ok = true;
+    if (exception_setup(true)) {
+        element_t *e;
+        list_for_each_entry (e, current->q, list) {
+            if (snap->size >= current->size)
+                break;
+            char *value = strdup(e->value);
+            if (!value) {
+                ok = false;
+                break;
+            }
+            snap->values[snap->size++] = value;
+        }
+    } else {
+        ok = false;
+    }
+    exception_cancel();
+
+    if (!ok)
+        snapshot_free(snap);
+    return ok;
+}
+
+/* Replace contents of current queue with copy of snapshot */
+static bool snapshot_restore(const snapshot_t *snap)
+{
+    bool ok = true;
+    if (exception_setup(true)) {
+        element_t *e, *safe;
+        list_for_each_entry_safe (e, safe, current->q, list) {
+            list_del(&e->list);
+            q_release_element(e);
+        }
+        for (int i = 0; ok && i < snap->size; i++) {
+            e = test_malloc(sizeof(element_t));
+            if (e)
+                e->value = test_strdup(snap->values[i]);
+            if (!e || !e->value) {
+                test_free(e);
+                ok = false;
+                break;
+            }
+            list_add_tail(&e->list, current->q);
+        }
+    } else {
+        ok = false;
+    }
+    exception_cancel();
+
+    /* Size is what was put back, not what q_size under test makes of it */
+    if (ok) {
+        current->size = snap->size;
+    } else {
+        struct list_head *node;
+        current->size = 0;
+        list_for_each (node, current->q)
+            current->size++;
+    }
+    return ok;
+}
+
+static int cmp_sample(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void bench_report(const char *unit, uint64_t *samples, int n)
+{
+    qsort(samples, n, sizeof(uint64_t), cmp_sample);
+
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += samples[i];
+    double mean = sum / n;
+    double var = 0;
+    for (int i = 0; i < n; i++)
+        var += (samples[i] - mean) * (samples[i] - mean);
+    double stddev = n > 1 ? sqrt(var / (n - 1)) : 0;
+
+    double median = n % 2 ? samples[n / 2]
+                          : (samples[n / 2 - 1] + samples[n / 2]) / 2.0;
+    /* Nearest-rank percentile */
+    int p99 = (99 * n + 99) / 100 - 1;
+
+    report(1, "%-6s %12" PRIu64 " %12.0f %12.0f %12.0f %12" PRIu64, unit,
+           samples[0], median, mean, stddev, samples[p99]);
+}
+
+/* Commands that change the set of queues, which a snapshot cannot undo */
+static const char *const bench_forbidden[] = {
+    "new", "free", "prev", "next", "merge", "bench", "wsbench", NULL,
+};
+
+static bool do_bench(int argc, char *argv[])
+{
+    int warmup = 5, reps = 100;
+    int i = 1;
+    while (i + 1 < argc && argv[i][0] == '-') {
+        int *loc = !strcmp(argv[i], "-w")   ? &warmup
+                   : !strcmp(argv[i], "-n") ? &reps
+                                            : NULL;
+        if (!loc || !get_int(argv[i + 1], loc) || *loc < 0) {
+            report(1, "Usage: %s [-w W] [-n N] cmd args ...", argv[0]);
+            return false;
+        }
+        i += 2;
+    }
+    if (i >= argc || reps < 1) {
+        report(1, "Usage: %s [-w W] [-n N] cmd args ...", argv[0]);
+        return false;
+    }
+
+    if (!find_command(argv[i])) {
+        report(1, "Unknown command '%s'", argv[i]);
+        return false;
+    }
+    for (const char *const *f = bench_forbidden; *f; f++) {
+        if (!strcmp(argv[i], *f)) {
+            report(1, "%s changes the set of queues; cannot repeat it",
+                   argv[i]);
+            return false;
+        }
+    }
+    if (!current || !current->q) {
+        report(1, "Calling %s on null queue", argv[0]);
+        return false;
+    }
+
+    snapshot_t snap;
+    if (!snapshot_take(&snap)) {
+        report(1, "Could not save queue contents");
+        return false;
+    }
+    uint64_t *ns = malloc(sizeof(uint64_t) * reps);
+    uint64_t *cycles = malloc(sizeof(uint64_t) * reps);
+    if (!ns || !cycles) {
+        free(ns);
+        free(cycles);
+        snapshot_free(&snap);
+        report(1, "Could not allocate samples");
+        return false;
+    }
+
+    /* Output of each run would only get in the way */
+    int saved_verblevel = verblevel;
+    if (verblevel > 1)
+        set_verblevel(1);
+
+    queue_contex_t *qctx = current;
+    int nqueues = chain.size;
+    bool ok = true;
+    for (int r = -warmup; ok && r < reps; r++) {
+        if (!snapshot_restore(&snap)) {
+            report(1, "Could not restore queue contents");
+            ok = false;
+            break;
+        }
+        uint64_t start = time_ns();
+        int64_t start_cycles = cpucycles();
+        ok = run_command(argc - i, argv + i);
+        int64_t end_cycles = cpucycles();
+        uint64_t end = time_ns();
+        if (current != qctx || chain.size != nqueues) {
+            report(1, "%s changed the set of queues; cannot repeat it",
+                   argv[i]);
+            ok = false;
+        }
+        if (ok && r >= 0) {
+            ns[r] = end - start;
+            cycles[r] = end_cycles - start_cycles;
+        }
+    }
+
+    set_verblevel(saved_verblevel);
+    if (ok) {
+        report(1, "%-6s %12s %12s %12s %12s %12s", "", "min", "median", "mean",
+               "stddev", "p99");
+        bench_report("ns", ns, reps);
+        bench_report("cycles", cycles, reps);
+    }
+
+    /* Leave queue as it was */
+    if (current == qctx && chain.size == nqueues)
+        snapshot_restore(&snap);
+
+    free(ns);
+    free(cycles);
+    snapshot_free(&snap);
+    return ok;
+}
+
+#define WS_THREADS_MAX 256
+
+static bool do_wsbench(int argc, char *argv[])
+{
+    int threads = sysconf(_SC_NPROCESSORS_ONLN), depth = 20, work = 100;
+    if (threads < 1)
+        threads = 1;
+    int i = 1;
+    while (i + 1 < argc && argv[i][0] == '-') {
+        int *loc = !strcmp(argv[i], "-t")   ? &threads
+                   : !strcmp(argv[i], "-d") ? &depth
+                   : !strcmp(argv[i], "-w") ? &work
+                                            : NULL;
+        if (!loc || !get_int(argv[i + 1], loc))
+            break;
+        i += 2;
+    }
+    if (i != argc || threads < 1 || threads > WS_THREADS_MAX || depth < 0 ||
+        depth > 30 || work < 0) {
+        report(1, "Usage: %s [-t threads] [-d depth 0-30] [-w work]",
+               argv[0]);
+        return false;
+    }
+
+    ws_bench_t r;
+    if (!ws_bench_run(threads, depth, work, &r)) {
+        report(1, "Could not start %d workers", threads);
+        return false;
+    }
+    double secs = r.ns / 1e9;
+    report(1, "%d threads: %" PRIu64 " tasks in %.3f s (%.0f tasks/s)", threads,
+           r.tasks, secs, secs > 0 ? r.tasks / secs : 0.0);
+    report(1, "%" PRIu64 " steals of %" PRIu64 " attempts (%.2f%% of tasks)",
+           r.steals, r.attempts, r.tasks ? 100.0 * r.steals / r.tasks : 0.0);
+    if (!r.valid) {
+        report(1, "ERROR: Tasks did not add up to expected result");
+        return false;
+    }
+    return true;
+}
+
+/* Shared-memory ring that other processes fill for this queue */
+static shm_ring_t shm_ring;
+static char *shm_name = NULL;
+
+#define SHM_SLOTS 65536
+#define SHM_TEXT 64
+
+/* Let go of ring.  This process is its only consumer, so the name goes too */
+static bool shm_quit(int argc, char *argv[])
+{
+    if (shm_name) {
+        shm_ring_detach(&shm_ring);
+        shm_unlink(shm_name);
+        free(shm_name);
+        shm_name = NULL;
+    }
+    return true;
+}
+
+static bool do_shmcreate(int argc, char *argv[])
+{
+    int slots = SHM_SLOTS, text_size = SHM_TEXT;
+    if (argc < 2 || argc > 4) {
+        report(1, "%s needs 1-3 arguments", argv[0]);
+        return false;
+    }
+    if (argc > 2 &&
+        (!get_int(argv[2], &slots) || slots < 1 || (slots & (slots - 1)))) {
+        report(1, "Number of slots '%s' is not a power of 2", argv[2]);
+        return false;
+    }
+    if (argc > 3 && (!get_int(argv[3], &text_size) || text_size < 2 ||
+                     text_size > MAXSTRING)) {
+        report(1, "Slot size '%s' is not between 2 and %d", argv[3],
+               MAXSTRING);
+        return false;
+    }
+
+    shm_quit(0, NULL);
+    if (!shm_ring_create(&shm_ring, argv[1], slots, text_size)) {
+        report(1, "Could not create ring %s: %s", argv[1], strerror(errno));
+        return false;
+    }
+    shm_name = strdup(argv[1]);
+    report(1, "Ring %s: %d slots of %d bytes", argv[1], slots, text_size);
+    return true;
+}
+
+static bool do_shmattach(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    shm_quit(0, NULL);
+    if (!shm_ring_attach(&shm_ring, argv[1])) {
+        report(1, "Could not attach ring %s: %s", argv[1], strerror(errno));
+        return false;
+    }
+    shm_name = strdup(argv[1]);
+    report(1, "Ring %s: %u slots of %u bytes, %zu waiting", argv[1],
+           shm_ring.nslots, shm_ring.text_size,
+           shm_ring_count(&shm_ring));
+    return true;
+}
+
+/* Move strings waiting in ring to tail of queue */
+static bool do_shmdrain(int argc, char *argv[])
+{
+    int limit = -1;
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 2 && (!get_int(argv[1], &limit) || limit < 0)) {
+        report(1, "Invalid number of strings '%s'", argv[1]);
+        return false;
+    }
+    if (!shm_name) {
+        report(1, "No ring; use shmcreate or shmattach first");
+        return false;
+    }
+    if (!current || !current->q) {
+        report(1, "Calling %s on null queue", argv[0]);
+        return false;
+    }
+    error_check();
+
+    char *text = malloc(shm_ring.text_size);
+    if (!text) {
+        report(1, "Could not allocate buffer for ring strings");
+        return false;
+    }
+    bool ok = true;
+    int drained = 0;
+    if (exception_setup(true)) {
+        while (ok && drained != limit && shm_ring_peek(&shm_ring, text)) {
+            if (q_insert_tail(current->q, text)) {
+                current->size++;
+            } else {
+                fail_count++;
+                if (fail_count < fail_limit)
+                    report(2, "Insertion of %s failed", text);
+                else {
+                    report(1,
+                           "ERROR: Insertion of %s failed (%d failures total)",
+                           text, fail_count);
+                    ok = false;
+                }
+            }
+            shm_ring_release(&shm_ring);
+            drained++;
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+    free(text);
+
+    report(2, "Drained %d strings, %zu left in ring", drained,
+           shm_ring_count(&shm_ring));
+    q_show(3);
+    return ok;
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1052,10 +1594,56 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
+    ADD_COMMAND(heapprof,
+                "Show top n allocation sites (default: n == 10), live blocks "
+                "by site, or clear the totals",
+                "[n|leaks|reset]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
-    add_param("malloc", &fail_probability, "Malloc failure probability percent",
+    ADD_COMMAND(fault,
+                "Show fault injection schedule, turn it off, or restrict it "
+                "to one command ('any' for all)",
+                "[off|cmd name]");
+    ADD_COMMAND(budget,
+                "Show time budgets, or set budget of command cmd in "
+                "milliseconds (-1 = default budget)",
+                "[cmd ms]");
+    add_param("budget", &time_budget,
+              "Default time budget of queue operations in ms (0 = none)",
               NULL);
+    add_param("guardtime", &show_guard_time,
+              "Show time used by each queue operation", NULL);
+    ADD_COMMAND(mem, "Show memory used by each queue", "");
+    ADD_COMMAND(bench,
+                "Time W warmup and N measured runs of command, restoring "
+                "queue before each",
+                "[-w W] [-n N] cmd arg ...");
+    ADD_COMMAND(wsbench,
+                "Run fork-join task tree on work-stealing deques, reporting "
+                "throughput and steals",
+                "[-t threads] [-d depth] [-w work]");
+    ADD_COMMAND(shmcreate,
+                "Create shared-memory ring of slots strings of up to size "
+                "bytes (default: 65536 slots, 64 bytes)",
+                "name [slots] [size]");
+    ADD_COMMAND(shmattach, "Attach shared-memory ring made by another process",
+                "name");
+    ADD_COMMAND(shmdrain,
+                "Move up to n strings from shared-memory ring to tail of "
+                "queue (default: all waiting)",
+                "[n]");
+    add_param("qmem", &mem_quota,
+              "Memory quota of each queue in bytes (0 = unlimited)", NULL);
+    add_param("malloc", &fail_probability, "Malloc failure probability percent",
+              fault_changed);
+    add_param("malloc_nth", &fail_nth, "Fail the nth allocation (0 = off)",
+              fault_changed);
+    add_param("malloc_every", &fail_every,
+              "Fail every nth allocation (0 = off)", fault_changed);
+    add_param("malloc_size", &fail_size,
+              "Fail allocations larger than n bytes (0 = off)", fault_changed);
+    add_param("malloc_seed", &fail_seed,
+              "Seed of malloc failure stream (0 = random)", fault_changed);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
@@ -1089,6 +1677,48 @@ static void q_init()
     signal(SIGALRM, sigalrm_handler);
 }
 
+static bool select_queue(int id)
+{
+    queue_contex_t *qctx;
+    list_for_each_entry (qctx, &chain.head, chain) {
+        if (qctx->id == id) {
+            current = qctx;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Samples of queue and allocator state for /metrics */
+static void queue_metrics()
+{
+    metrics_printf("# HELP qtest_queue_size Elements in queue.\n"
+                   "# TYPE qtest_queue_size gauge\n");
+    queue_contex_t *qctx;
+    list_for_each_entry (qctx, &chain.head, chain)
+        metrics_printf("qtest_queue_size{id=\"%d\"} %d\n", qctx->id,
+                       qctx->size);
+    metrics_printf("# HELP qtest_queue_bytes Bytes allocated for queue.\n"
+                   "# TYPE qtest_queue_bytes gauge\n");
+    list_for_each_entry (qctx, &chain.head, chain)
+        metrics_printf("qtest_queue_bytes{id=\"%d\"} %zu\n", qctx->id,
+                       atomic_load(&queue_info(qctx)->mem.bytes));
+
+    size_t allocs, bytes;
+    allocation_totals(&allocs, &bytes);
+    metrics_printf(
+        "# HELP qtest_heap_blocks Blocks allocated by queue code.\n"
+        "# TYPE qtest_heap_blocks gauge\n"
+        "qtest_heap_blocks %zu\n"
+        "# HELP qtest_heap_allocs_total Allocations by queue code.\n"
+        "# TYPE qtest_heap_allocs_total counter\n"
+        "qtest_heap_allocs_total %zu\n"
+        "# HELP qtest_heap_alloc_bytes_total Bytes allocated by queue code.\n"
+        "# TYPE qtest_heap_alloc_bytes_total counter\n"
+        "qtest_heap_alloc_bytes_total %zu\n",
+        allocation_check(), allocs, bytes);
+}
+
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
@@ -1101,7 +1731,8 @@ static bool q_quit(int argc, char *argv[])
             queue_contex_t *qctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
             q_free(qctx->q);
-            free(qctx);
+            mem_account_move(&queue_info(qctx)->mem, NULL);
+            free(queue_info(qctx));
             chain.size--;
         }
     }
@@ -1113,19 +1744,154 @@ static bool q_quit(int argc, char *argv[])
     if (bcnt > 0) {
         report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
                bcnt);
+        heap_profile_report(0, true);
         return false;
     }
 
     return true;
 }
 
+/* Machine-readable records of every command, written to stdout */
+typedef enum {
+    RECORD_NONE,
+    RECORD_JSON,
+    RECORD_CSV,
+} record_format_t;
+
+static record_format_t record_format = RECORD_NONE;
+static FILE *record_file = NULL;
+
+/* Allocation totals when each (possibly nested) command started */
+#define RECORD_DEPTH 8
+static size_t record_allocs[RECORD_DEPTH];
+static size_t record_bytes[RECORD_DEPTH];
+static int record_depth = 0;
+
+static void record_start_hook(int argc, char *argv[])
+{
+    if (record_depth < RECORD_DEPTH)
+        allocation_totals(&record_allocs[record_depth],
+                          &record_bytes[record_depth]);
+    record_depth++;
+}
+
+static void json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void csv_field(FILE *f, int argc, char *argv[])
+{
+    bool quote = false;
+    for (int i = 0; i < argc; i++)
+        quote = quote || strpbrk(argv[i], ",\"\r\n") != NULL;
+
+    if (quote)
+        fputc('"', f);
+    for (int i = 0; i < argc; i++) {
+        if (i > 0)
+            fputc(' ', f);
+        for (const char *s = argv[i]; *s; s++) {
+            if (*s == '"')
+                fputc('"', f);
+            fputc(*s, f);
+        }
+    }
+    if (quote)
+        fputc('"', f);
+}
+
+static void record_hook(int argc, char *argv[], bool ok, uint64_t elapsed)
+{
+    size_t allocs = 0, bytes = 0;
+    if (--record_depth < RECORD_DEPTH) {
+        allocation_totals(&allocs, &bytes);
+        allocs -= record_allocs[record_depth];
+        bytes -= record_bytes[record_depth];
+    }
+    int size = current ? current->size : -1;
+
+    if (record_format == RECORD_JSON) {
+        fputs("{\"cmd\":", record_file);
+        json_string(record_file, argv[0]);
+        fputs(",\"args\":[", record_file);
+        for (int i = 1; i < argc; i++) {
+            if (i > 1)
+                fputc(',', record_file);
+            json_string(record_file, argv[i]);
+        }
+        fprintf(record_file,
+                "],\"elapsed_ns\":%lu,\"allocs\":%lu,\"bytes\":%lu,"
+                "\"queue_size\":%d,\"ok\":%s}\n",
+                (unsigned long) elapsed, allocs, bytes, size,
+                ok ? "true" : "false");
+    } else {
+        csv_field(record_file, 1, argv);
+        fputc(',', record_file);
+        csv_field(record_file, argc - 1, argv + 1);
+        fprintf(record_file, ",%lu,%lu,%lu,%d,%s\n", (unsigned long) elapsed,
+                allocs, bytes, size, ok ? "ok" : "error");
+    }
+}
+
+static void record_close()
+{
+    if (record_file)
+        fclose(record_file);
+    record_file = NULL;
+}
+
+/* Start writing records in given format.  Return false if unknown */
+static bool record_open(const char *format)
+{
+    if (!strcasecmp(format, "json"))
+        record_format = RECORD_JSON;
+    else if (!strcasecmp(format, "csv"))
+        record_format = RECORD_CSV;
+    else
+        return false;
+
+    /* Records get their own, fully buffered stream, so that writing them
+     * costs a memcpy per command rather than a system call.  Everything
+     * meant for humans moves to stderr to keep stdout parseable.
+     */
+    record_file = fdopen(dup(STDOUT_FILENO), "w");
+    if (!record_file)
+        return false;
+    setvbuf(record_file, NULL, _IOFBF, 1 << 16);
+    set_report_file(stderr);
+
+    if (record_format == RECORD_CSV)
+        fputs("cmd,args,elapsed_ns,allocs,bytes,queue_size,status\n",
+              record_file);
+    add_cmd_hook(record_start_hook);
+    add_cmd_done_hook(record_hook);
+    atexit(record_close);
+    return true;
+}
+
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf(
+        "Usage: %s [-h] [-f IFILE][-b PROG][-v VLEVEL][-l LFILE][-o FORMAT]\n",
+        cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-b PROG    Run program PROG made by the compile command\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-o FORMAT  Write a json or csv record of every command to "
+           "stdout\n");
     exit(0);
 }
 
@@ -1193,10 +1959,12 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char *record_name = NULL;
+    char *prog_name = NULL;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:b:l:o:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1221,6 +1989,12 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'o':
+            record_name = optarg;
+            break;
+        case 'b':
+            prog_name = optarg;
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1238,7 +2012,7 @@ int main(int argc, char *argv[])
     console_init();
 
     /* Initialize linenoise only when infile_name not exist */
-    if (!infile_name) {
+    if (!infile_name && !prog_name) {
         /* Trigger call back function(auto completion) */
         line_set_completion_callback(completion);
 
@@ -1253,9 +2027,23 @@ int main(int argc, char *argv[])
         set_logfile(logfile_name);
 
     add_quit_helper(q_quit);
+    add_quit_helper(shm_quit);
+    add_metrics_helper(queue_metrics);
+    set_queue_selector(select_queue);
+    add_cmd_hook(fault_hook);
+    add_cmd_hook(budget_hook);
+    add_cmd_hook(mem_hook);
+    if (record_name && !record_open(record_name)) {
+        fprintf(stderr, "Unknown output format '%s'\n", record_name);
+        exit(EXIT_FAILURE);
+    }
+    fault_reset();
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
+    if (prog_name)
+        ok = ok && run_program(prog_name);
+    else
+        ok = ok && run_console(infile_name);
 
     /* Do finish_cmd() before check whether ok is true or false */
     ok = finish_cmd() && ok;
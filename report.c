@@ -1,19 +1,27 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "poller.h"
 #include "report.h"
 #include "web.h"
 
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
 
+#define BUF_SIZE 4096
+
 static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
@@ -25,6 +33,49 @@ static void init_files(FILE *efile, FILE *vfile)
     verbfile = vfile;
 }
 
+/* Asynchronous output.
+ * When enabled, messages are formatted into ring buffers, one for the
+ * terminal and one for the log file.  A writer thread drains them with
+ * writev, so reporting does not wait for the terminal or the disk.
+ * Every thread that reports gets its own pair of rings, which only it
+ * fills, so no locks are taken: a message becomes visible to the writer
+ * by one store of head, once it has been copied in whole.  A thread that
+ * is interrupted by a time limit halfway through a message simply never
+ * publishes it.  Messages of one thread come out in order, but those of
+ * different threads may not.
+ */
+#define RING_SIZE (1 << 20) /* Must be a power of 2 */
+
+typedef struct {
+    char buf[RING_SIZE];
+    atomic_size_t head; /* Total bytes produced */
+    atomic_size_t tail; /* Total bytes consumed */
+} log_ring_t;
+
+/* Rings of one reporting thread.  They are never freed; those of a thread
+ * that exits are taken over by the next thread to report.
+ */
+typedef struct producer {
+    log_ring_t out, log;
+    atomic_bool owned;
+    struct producer *next;
+} producer_t;
+
+static _Atomic(producer_t *) producers = NULL;
+static __thread producer_t *self_producer = NULL;
+static pthread_key_t producer_key;
+static pthread_once_t producer_key_once = PTHREAD_ONCE_INIT;
+
+static atomic_int out_fd = -1;
+static atomic_int log_fd = -1;
+
+static atomic_bool async_enabled = false;
+static atomic_bool writer_stop = false;
+static atomic_bool writer_idle = false;
+static pthread_t writer_thread;
+static int wake_fd[2] = {-1, -1};    /* Rings have data for the writer */
+static int drained_fd[2] = {-1, -1}; /* Writer has emptied the rings */
+
 static char fail_buf[1024] = "FATAL Error.  Exiting\n";
 
 static volatile int ret = 0;
@@ -40,14 +91,277 @@ static void default_fatal_fun()
 /* Optional function to call when fatal error encountered */
 static void (*fatal_fun)() = default_fatal_fun;
 
+void set_report_file(FILE *file)
+{
+    report_flush();
+    init_files(file, file);
+    atomic_store(&out_fd, fileno(file));
+}
+
 void set_verblevel(int level)
 {
     verblevel = level;
 }
 
+static bool ring_empty(log_ring_t *ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) ==
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+static bool rings_empty()
+{
+    for (producer_t *p = atomic_load(&producers); p; p = p->next) {
+        if (!ring_empty(&p->out) || !ring_empty(&p->log))
+            return false;
+    }
+    return true;
+}
+
+/* Write out everything produced so far.  Return number of bytes written */
+static size_t ring_drain(log_ring_t *ring, int fd)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t total = 0;
+
+    while (tail != head) {
+        size_t start = tail & (RING_SIZE - 1);
+        size_t len = head - tail;
+        struct iovec iov[2];
+        int iovcnt = 1;
+        iov[0].iov_base = ring->buf + start;
+        if (start + len <= RING_SIZE) {
+            iov[0].iov_len = len;
+        } else {
+            /* Wrapped around the end of the buffer */
+            iov[0].iov_len = RING_SIZE - start;
+            iov[1].iov_base = ring->buf;
+            iov[1].iov_len = len - iov[0].iov_len;
+            iovcnt = 2;
+        }
+
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            /* Nowhere to write to.  Drop the data rather than spin */
+            n = len;
+        }
+        tail += n;
+        total += n;
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    return total;
+}
+
+static void *writer_main(void *arg)
+{
+    for (;;) {
+        size_t written = 0;
+        for (producer_t *p = atomic_load(&producers); p; p = p->next) {
+            written += ring_drain(&p->out, atomic_load(&out_fd));
+            written += ring_drain(&p->log, atomic_load(&log_fd));
+        }
+        if (written) {
+            /* Let more output accumulate, so that writes are batched */
+            struct timespec linger = {0, 200 * 1000};
+            nanosleep(&linger, NULL);
+            continue;
+        }
+
+        wakeup_signal(drained_fd);
+        if (atomic_load(&writer_stop))
+            break;
+        /* Producers check writer_idle after publishing, so either they
+         * see it set and wake the writer, or it sees what they published.
+         */
+        atomic_store(&writer_idle, true);
+        if (rings_empty()) {
+            struct pollfd pfd = {.fd = wake_fd[0], .events = POLLIN};
+            poll(&pfd, 1, -1);
+        }
+        wakeup_clear(wake_fd);
+        atomic_store(&writer_idle, false);
+    }
+    return NULL;
+}
+
+static void release_producer(void *arg)
+{
+    producer_t *p = arg;
+    atomic_store(&p->owned, false);
+}
+
+static void make_producer_key()
+{
+    pthread_key_create(&producer_key, release_producer);
+}
+
+/* Find rings of calling thread, attaching a pair on first use */
+static producer_t *get_producer()
+{
+    if (self_producer)
+        return self_producer;
+
+    pthread_once(&producer_key_once, make_producer_key);
+
+    producer_t *p = atomic_load(&producers);
+    for (; p; p = p->next) {
+        bool unowned = false;
+        if (atomic_compare_exchange_strong(&p->owned, &unowned, true))
+            break;
+    }
+    if (!p) {
+        p = calloc(1, sizeof(producer_t));
+        if (!p)
+            return NULL;
+        atomic_store(&p->owned, true);
+        p->next = atomic_load(&producers);
+        while (!atomic_compare_exchange_weak(&producers, &p->next, p))
+            ;
+    }
+
+    pthread_setspecific(producer_key, p);
+    self_producer = p;
+    return p;
+}
+
+/* Append len bytes of text to ring, waiting for room if it is full.
+ * Nothing is visible to the writer until all of it has been copied.
+ */
+static void ring_put(log_ring_t *ring, const char *text, size_t len)
+{
+    if (len > RING_SIZE)
+        len = RING_SIZE;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    for (;;) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (RING_SIZE - (head - tail) >= len)
+            break;
+        wakeup_signal(wake_fd);
+        struct timespec pause = {0, 50 * 1000};
+        nanosleep(&pause, NULL);
+    }
+
+    size_t start = head & (RING_SIZE - 1);
+    size_t first = len < RING_SIZE - start ? len : RING_SIZE - start;
+    memcpy(ring->buf + start, text, first);
+    memcpy(ring->buf, text + first, len - first);
+    atomic_store_explicit(&ring->head, head + len, memory_order_release);
+}
+
+/* Queue formatted text for the terminal, and optionally for the log file */
+static void async_emit(const char *out, const char *log)
+{
+    producer_t *p = get_producer();
+    if (!p) {
+        /* No rings to be had, so write directly */
+        if (out)
+            ret = write(atomic_load(&out_fd), out, strlen(out));
+        if (log && logfile)
+            ret = write(atomic_load(&log_fd), log, strlen(log));
+        return;
+    }
+
+    if (out)
+        ring_put(&p->out, out, strlen(out));
+    if (log && logfile)
+        ring_put(&p->log, log, strlen(log));
+
+    /* Writer only needs waking when it has gone idle */
+    if (atomic_load(&writer_idle))
+        wakeup_signal(wake_fd);
+}
+
+/* Wait for the writer to empty the rings.  It takes no locks, so that it
+ * can be called from any path, failing ones included.
+ */
+void report_flush()
+{
+    if (!atomic_load(&async_enabled))
+        return;
+
+    while (!rings_empty()) {
+        wakeup_signal(wake_fd);
+        struct pollfd pfd = {.fd = drained_fd[0], .events = POLLIN};
+        poll(&pfd, 1, 10);
+        wakeup_clear(drained_fd);
+    }
+}
+
+static void async_stop()
+{
+    if (!atomic_load(&async_enabled))
+        return;
+
+    report_flush();
+    atomic_store(&writer_stop, true);
+    wakeup_signal(wake_fd);
+    pthread_join(writer_thread, NULL);
+    atomic_store(&async_enabled, false);
+}
+
+bool set_async_output(bool on)
+{
+    static bool registered = false;
+
+    if (!on) {
+        async_stop();
+        return true;
+    }
+    if (atomic_load(&async_enabled))
+        return true;
+
+    if (!verbfile)
+        init_files(stdout, stdout);
+    if (wake_fd[0] < 0 && !wakeup_open(wake_fd))
+        return false;
+    if (drained_fd[0] < 0 && !wakeup_open(drained_fd))
+        return false;
+    /* Rings of this thread are set up now, rather than by its first report,
+     * which may be in the middle of a guarded operation.
+     */
+    if (!get_producer())
+        return false;
+
+    /* Anything already buffered by stdio goes out first */
+    fflush(verbfile);
+    atomic_store(&out_fd, fileno(verbfile));
+    atomic_store(&log_fd, -1);
+    if (logfile) {
+        fflush(logfile);
+        atomic_store(&log_fd, fileno(logfile));
+    }
+
+    atomic_store(&writer_stop, false);
+    /* Time limits and interrupts are for the interpreter thread */
+    sigset_t mask, saved;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &saved);
+    bool started = !pthread_create(&writer_thread, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (!started)
+        return false;
+    atomic_store(&async_enabled, true);
+
+    /* Make sure nothing is left behind when the program exits */
+    if (!registered) {
+        atexit(async_stop);
+        registered = true;
+    }
+    return true;
+}
+
 bool set_logfile(const char *file_name)
 {
-    logfile = fopen(file_name, "w");
+    report_flush();
+    /* Readable too, so that it can be served over the web */
+    logfile = fopen(file_name, "w+");
+    if (logfile)
+        atomic_store(&log_fd, fileno(logfile));
     return logfile != NULL;
 }
 
@@ -71,6 +385,23 @@ void report_event(message_t msg, char *fmt, ...)
     if (!errfile)
         init_files(stdout, stdout);
 
+    if (atomic_load(&async_enabled)) {
+        char text[BUF_SIZE], out[BUF_SIZE + 32], log[BUF_SIZE + 32];
+        va_start(ap, fmt);
+        vsnprintf(text, sizeof(text), fmt, ap);
+        va_end(ap);
+        snprintf(out, sizeof(out), "%s: %s\n", msg_name, text);
+        snprintf(log, sizeof(log), "Error: %s\n", text);
+        async_emit(out, log);
+        if (fatal) {
+            report_flush();
+            if (fatal_fun)
+                fatal_fun();
+            exit(1);
+        }
+        return;
+    }
+
     va_start(ap, fmt);
     fprintf(errfile, "%s: ", msg_name);
     vfprintf(errfile, fmt, ap);
@@ -95,15 +426,41 @@ void report_event(message_t msg, char *fmt, ...)
     }
 }
 
-#define BUF_SIZE 4096
-extern int web_connfd;
+/* Receiver of output captured for web client, or NULL */
+static report_sink_t capture = NULL;
+static void *capture_arg = NULL;
+
+void set_report_capture(report_sink_t sink, void *arg)
+{
+    capture = sink;
+    capture_arg = arg;
+}
+
+int report_log_fd()
+{
+    report_flush();
+    if (!logfile)
+        return -1;
+    fflush(logfile);
+    return fileno(logfile);
+}
+
 void report(int level, char *fmt, ...)
 {
     if (!verbfile)
         init_files(stdout, stdout);
 
     char buffer[BUF_SIZE];
-    if (level <= verblevel) {
+    if (level <= verblevel && atomic_load(&async_enabled)) {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(buffer, BUF_SIZE - 1, fmt, ap);
+        va_end(ap);
+        strcat(buffer, "\n");
+        async_emit(buffer, buffer);
+        if (capture)
+            capture(capture_arg, buffer, strlen(buffer));
+    } else if (level <= verblevel) {
         va_list ap;
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
@@ -118,15 +475,13 @@ void report(int level, char *fmt, ...)
             fflush(logfile);
             va_end(ap);
         }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
-    }
-    if (web_connfd) {
-        int len = strlen(buffer);
-        buffer[len] = '\n';
-        buffer[len + 1] = '\0';
-        web_send(web_connfd, buffer);
+        if (capture) {
+            va_start(ap, fmt);
+            vsnprintf(buffer, BUF_SIZE - 1, fmt, ap);
+            va_end(ap);
+            strcat(buffer, "\n");
+            capture(capture_arg, buffer, strlen(buffer));
+        }
     }
 }
 
@@ -136,7 +491,15 @@ void report_noreturn(int level, char *fmt, ...)
         init_files(stdout, stdout);
 
     char buffer[BUF_SIZE];
-    if (level <= verblevel) {
+    if (level <= verblevel && atomic_load(&async_enabled)) {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(buffer, BUF_SIZE, fmt, ap);
+        va_end(ap);
+        async_emit(buffer, buffer);
+        if (capture)
+            capture(capture_arg, buffer, strlen(buffer));
+    } else if (level <= verblevel) {
         va_list ap;
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
@@ -149,13 +512,13 @@ void report_noreturn(int level, char *fmt, ...)
             fflush(logfile);
             va_end(ap);
         }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
+        if (capture) {
+            va_start(ap, fmt);
+            vsnprintf(buffer, BUF_SIZE, fmt, ap);
+            va_end(ap);
+            capture(capture_arg, buffer, strlen(buffer));
+        }
     }
-
-    if (web_connfd)
-        web_send(web_connfd, buffer);
 }
 
 /* Functions denoting failures */
@@ -163,6 +526,9 @@ void report_noreturn(int level, char *fmt, ...)
 /* Need to be able to print without using malloc */
 static void fail_fun(const char *format, const char *msg)
 {
+    /* Earlier messages must not be lost behind the fatal one */
+    report_flush();
+
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
@@ -266,6 +632,14 @@ char *strsave_or_fail(const char *s, const char *fun_name)
     return strncpy(ss, s, len + 1);
 }
 
+void alloc_stats(size_t *allocs, size_t *frees, size_t *current, size_t *peak)
+{
+    *allocs = allocate_cnt;
+    *frees = free_cnt;
+    *current = current_bytes;
+    *peak = peak_bytes;
+}
+
 /* Free block, as from malloc, realloc, or strsave */
 void free_block(void *b, size_t bytes)
 {
@@ -306,10 +680,15 @@ void init_time(double *timep)
 
 double delta_time(double *timep)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double current_time = tv.tv_sec + 1.0E-6 * tv.tv_usec;
+    double current_time = 1.0E-9 * time_ns();
     double delta = current_time - *timep;
     *timep = current_time;
     return delta;
 }
+
+uint64_t time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
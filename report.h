@@ -3,6 +3,8 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 
 /* Ways to report interesting behavior and errors */
 
@@ -14,6 +16,27 @@ typedef enum { MSG_WARN, MSG_ERROR, MSG_FATAL, N_MSG } message_t;
 
 bool set_logfile(const char *file_name);
 
+/* Send messages to file instead of stdout */
+void set_report_file(FILE *file);
+
+/* Turn asynchronous output on/off.
+ * When on, messages are buffered and written by a background thread.
+ * Return false if the writer thread could not be started.
+ */
+bool set_async_output(bool on);
+
+/* Wait until all buffered output has been written */
+void report_flush();
+
+/* Also pass output of report and report_noreturn to sink, until called
+ * with NULL
+ */
+typedef void (*report_sink_t)(void *arg, const char *text, size_t len);
+void set_report_capture(report_sink_t sink, void *arg);
+
+/* Descriptor of log file with all output written to it, or -1 if none */
+int report_log_fd();
+
 extern int verblevel;
 void set_verblevel(int level);
 
@@ -44,10 +67,18 @@ void free_array(void *b, size_t cnt, size_t bytes);
 /* Free string saved by strsave_or_fail */
 void free_string(char *s);
 
+/* Report blocks allocated and freed by functions above, and bytes in use
+ * now and at most
+ */
+void alloc_stats(size_t *allocs, size_t *frees, size_t *current, size_t *peak);
+
 /* Time counted as fp number in seconds */
 void init_time(double *timep);
 
 /* Compute time since last call with this timer and reset timer */
 double delta_time(double *timep);
 
+/* Nanoseconds from monotonic clock, unaffected by changes to wall time */
+uint64_t time_ns();
+
 #endif /* LAB0_REPORT_H */
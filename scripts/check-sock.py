@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+
+# Check that qtest survives binary protocol clients hanging up early
+
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+SOCK_OP_CMD = 0
+SOCK_OP_NEW = 1
+SOCK_OP_IT = 4
+SOCK_OP_SIZE = 7
+SOCK_CURRENT = 0xffff
+
+
+def frame(op, args=()):
+    body = b''.join(struct.pack('=I', len(a)) + a for a in args)
+    return struct.pack('=IHBB', len(body), SOCK_CURRENT, op, len(args)) + body
+
+
+def connect(path):
+    for _ in range(100):
+        try:
+            s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            s.connect(path)
+            return s
+        except OSError:
+            s.close()
+            time.sleep(0.05)
+    sys.exit("Could not connect to %s" % path)
+
+
+def reply(s, buf):
+    while True:
+        if len(buf) >= 8:
+            length, _, op, _ = struct.unpack('=IHBB', buf[:8])
+            if len(buf) >= 8 + length:
+                return op, buf[12:8 + length], buf[8 + length:]
+        data = s.recv(65536)
+        if not data:
+            sys.exit("Connection closed before reply")
+        buf += data
+
+
+def main():
+    qtest = sys.argv[1] if len(sys.argv) > 1 else './qtest'
+    path = os.path.join(tempfile.mkdtemp(), 'qtest.sock')
+    proc = subprocess.Popen([qtest, '-v', '3'], stdin=subprocess.PIPE,
+                            stdout=subprocess.DEVNULL)
+    proc.stdin.write(('sock %s\n' % path).encode())
+    proc.stdin.flush()
+
+    # Pipeline requests, then hang up without reading any reply
+    for _ in range(5):
+        s = connect(path)
+        s.sendall(frame(SOCK_OP_CMD, [b'help']) * 50)
+        s.close()
+
+    s = connect(path)
+    s.sendall(frame(SOCK_OP_NEW) + frame(SOCK_OP_IT, [b'a']) +
+              frame(SOCK_OP_SIZE))
+    buf = b''
+    for _ in range(3):
+        op, text, buf = reply(s, buf)
+    s.close()
+
+    proc.stdin.write(b'quit\n')
+    proc.stdin.close()
+    status = proc.wait(timeout=10)
+    os.unlink(path)
+    if op != 0 or b'Queue size = 1' not in text or status != 0:
+        print("FAIL: reply %r, qtest exit status %d" % (text, status))
+        sys.exit(1)
+    print("OK")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,108 @@
+/* Push strings into a qtest shared-memory ring, for benchmarking.
+ *
+ * Usage: shmprod [-c slots] [-p procs] name count [str]
+ *
+ * Each of procs processes pushes count strings, str or else its running
+ * number, waiting whenever the ring is full, and prints how fast it went.
+ * With -c, the ring is created first and left for qtest to shmattach.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+#define TEXT_SIZE 64 /* Size of slots created with -c */
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int produce(const char *name, long count, const char *str)
+{
+    shm_ring_t ring;
+    if (!shm_ring_attach(&ring, name)) {
+        fprintf(stderr, "Could not attach ring %s: %s\n", name,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    char buf[32];
+    long full = 0;
+    double start = now();
+    for (long i = 0; i < count; i++) {
+        if (!str)
+            snprintf(buf, sizeof(buf), "%ld", i);
+        while (!shm_ring_push(&ring, str ? str : buf)) {
+            full++;
+            sched_yield();
+        }
+    }
+    double elapsed = now() - start;
+
+    printf("%d: %ld strings in %.3f s (%.0f/s), ring full %ld times\n",
+           getpid(), count, elapsed, count / elapsed, full);
+    shm_ring_detach(&ring);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    int procs = 1, slots = 0;
+    int c;
+    while ((c = getopt(argc, argv, "c:p:")) != -1) {
+        if (c == 'c' && (slots = atoi(optarg)) > 0)
+            continue;
+        if (c == 'p' && (procs = atoi(optarg)) > 0)
+            continue;
+        optind = argc; /* Bad option */
+        break;
+    }
+    if (argc - optind < 2 || argc - optind > 3) {
+        fprintf(stderr, "Usage: %s [-c slots] [-p procs] name count [str]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *name = argv[optind];
+    long count = atol(argv[optind + 1]);
+    const char *str = argc - optind == 3 ? argv[optind + 2] : NULL;
+
+    if (slots) {
+        shm_ring_t ring;
+        if (!shm_ring_create(&ring, name, slots, TEXT_SIZE)) {
+            fprintf(stderr, "Could not create ring %s: %s\n", name,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        shm_ring_detach(&ring);
+    }
+
+    if (procs == 1)
+        return produce(name, count, str);
+
+    fflush(stdout);
+    for (int i = 0; i < procs; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return EXIT_FAILURE;
+        }
+        if (pid == 0)
+            exit(produce(name, count, str));
+    }
+    int status, ok = EXIT_SUCCESS;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            ok = EXIT_FAILURE;
+    }
+    return ok;
+}
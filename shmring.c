@@ -0,0 +1,191 @@
+/* Ring of fixed-size string slots in POSIX shared memory */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+#define SHM_RING_MAGIC 0x51524e47 /* "QRNG" */
+#define CACHE_LINE 64
+
+#define load_relaxed(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/* Slot holds sequence number, then string.  Sequence number pos means slot
+ * is free for the producer claiming position pos, and pos + 1 that it holds
+ * the string pushed at pos.
+ */
+typedef struct {
+    uint64_t seq;
+    char text[];
+} shm_slot_t;
+
+static shm_slot_t *slot_at(shm_ring_t *ring, uint64_t pos)
+{
+    return (shm_slot_t *) (ring->slots + (size_t) (pos & (ring->nslots - 1)) *
+                                             ring->slot_size);
+}
+
+static size_t region_size(unsigned slots, unsigned slot_size)
+{
+    return sizeof(shm_ring_hdr_t) + (size_t) slots * slot_size;
+}
+
+bool shm_ring_create(shm_ring_t *ring,
+                     const char *name,
+                     unsigned slots,
+                     unsigned text_size)
+{
+    if (!slots || (slots & (slots - 1)) || !text_size) {
+        errno = EINVAL;
+        return false;
+    }
+    /* Whole cache lines, so that producers filling neighbouring slots do not
+     * contend for one line
+     */
+    unsigned slot_size =
+        (sizeof(shm_slot_t) + text_size + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+    size_t len = region_size(slots, slot_size);
+
+    /* Ring left by an earlier run may still be mapped by its producers, so
+     * start a new one rather than truncate it under them
+     */
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, len) < 0) {
+        int err = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = err;
+        return false;
+    }
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        int err = errno;
+        shm_unlink(name);
+        errno = err;
+        return false;
+    }
+
+    ring->hdr = map;
+    ring->slots = (char *) map + sizeof(shm_ring_hdr_t);
+    ring->map_len = len;
+    ring->nslots = ring->hdr->slots = slots;
+    ring->slot_size = ring->hdr->slot_size = slot_size;
+    ring->text_size = ring->hdr->text_size = text_size;
+    for (unsigned i = 0; i < slots; i++)
+        slot_at(ring, i)->seq = i;
+    store_release(&ring->hdr->magic, SHM_RING_MAGIC);
+    return true;
+}
+
+bool shm_ring_attach(shm_ring_t *ring, const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(shm_ring_hdr_t)) {
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+    void *map =
+        mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    /* Check a single read of each field, which is all that is used after */
+    shm_ring_hdr_t *hdr = map;
+    uint32_t magic = load_acquire(&hdr->magic);
+    uint32_t slots = load_relaxed(&hdr->slots);
+    uint32_t slot_size = load_relaxed(&hdr->slot_size);
+    uint32_t text_size = load_relaxed(&hdr->text_size);
+    if (magic != SHM_RING_MAGIC || !slots || (slots & (slots - 1)) ||
+        !text_size || slot_size % sizeof(uint64_t) ||
+        slot_size < sizeof(shm_slot_t) + (size_t) text_size ||
+        region_size(slots, slot_size) > (size_t) st.st_size) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return false;
+    }
+    ring->hdr = hdr;
+    ring->slots = (char *) map + sizeof(shm_ring_hdr_t);
+    ring->map_len = st.st_size;
+    ring->nslots = slots;
+    ring->slot_size = slot_size;
+    ring->text_size = text_size;
+    return true;
+}
+
+void shm_ring_detach(shm_ring_t *ring)
+{
+    munmap(ring->hdr, ring->map_len);
+    memset(ring, 0, sizeof(shm_ring_t));
+}
+
+bool shm_ring_push(shm_ring_t *ring, const char *s)
+{
+    shm_ring_hdr_t *hdr = ring->hdr;
+    uint64_t pos = load_relaxed(&hdr->head);
+    shm_slot_t *slot;
+    for (;;) {
+        slot = slot_at(ring, pos);
+        int64_t diff = (int64_t) (load_acquire(&slot->seq) - pos);
+        if (diff == 0) {
+            /* On failure pos is updated to the head another producer set */
+            if (__atomic_compare_exchange_n(&hdr->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return false; /* Consumer has not taken slot from last lap */
+        } else {
+            pos = load_relaxed(&hdr->head);
+        }
+    }
+
+    size_t len = strnlen(s, ring->text_size - 1);
+    memcpy(slot->text, s, len);
+    slot->text[len] = '\0';
+    store_release(&slot->seq, pos + 1);
+    return true;
+}
+
+bool shm_ring_peek(shm_ring_t *ring, char *buf)
+{
+    uint64_t pos = load_relaxed(&ring->hdr->tail);
+    shm_slot_t *slot = slot_at(ring, pos);
+    if (load_acquire(&slot->seq) != pos + 1)
+        return false;
+    /* Bounded copy, since producers are not trusted to have terminated it */
+    size_t len = strnlen(slot->text, ring->text_size - 1);
+    memcpy(buf, slot->text, len);
+    buf[len] = '\0';
+    return true;
+}
+
+void shm_ring_release(shm_ring_t *ring)
+{
+    shm_ring_hdr_t *hdr = ring->hdr;
+    uint64_t pos = load_relaxed(&hdr->tail);
+    /* Free for the producer one lap ahead */
+    store_release(&slot_at(ring, pos)->seq, pos + ring->nslots);
+    store_release(&hdr->tail, pos + 1);
+}
+
+size_t shm_ring_count(shm_ring_t *ring)
+{
+    uint64_t tail = load_acquire(&ring->hdr->tail);
+    uint64_t head = load_acquire(&ring->hdr->head);
+    return head > tail ? head - tail : 0;
+}
@@ -0,0 +1,68 @@
+#ifndef LAB0_SHMRING_H
+#define LAB0_SHMRING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Ring of fixed-size string slots in POSIX shared memory.
+ *
+ * Any number of processes may push strings into the ring, while one process
+ * takes them out.  Neither side takes a lock: a producer claims a slot by
+ * advancing head, fills it, then publishes it through the slot's sequence
+ * number, which the consumer waits on before reading.  A producer that dies
+ * between claiming and publishing a slot stalls the consumer at that slot.
+ */
+
+typedef struct {
+    uint32_t magic;     /* Written last, once ring is ready */
+    uint32_t slots;     /* Power of 2 */
+    uint32_t slot_size; /* Bytes between slots, sequence number included */
+    uint32_t text_size; /* Longest string kept, null byte included */
+    _Alignas(64) uint64_t head; /* Next slot producers claim */
+    _Alignas(64) uint64_t tail; /* Next slot consumer takes */
+} shm_ring_hdr_t;
+
+/* Layout fields are copied from the header once checked, since any process
+ * sharing the ring could change the header afterwards
+ */
+typedef struct {
+    shm_ring_hdr_t *hdr;
+    char *slots;
+    size_t map_len;
+    uint32_t nslots;
+    uint32_t slot_size;
+    uint32_t text_size;
+} shm_ring_t;
+
+/* Create ring called name, replacing any earlier one, with room for slots
+ * strings of up to text_size - 1 bytes.  Return false with errno set.
+ */
+bool shm_ring_create(shm_ring_t *ring,
+                     const char *name,
+                     unsigned slots,
+                     unsigned text_size);
+
+/* Map ring created by another process.  Return false with errno set */
+bool shm_ring_attach(shm_ring_t *ring, const char *name);
+
+void shm_ring_detach(shm_ring_t *ring);
+
+/* Copy string into ring, truncating it to fit a slot.  Return false if the
+ * ring is full.
+ */
+bool shm_ring_push(shm_ring_t *ring, const char *s);
+
+/* Copy string of oldest slot into buf, which holds text_size bytes, leaving
+ * the slot in place.  Return false if the ring is empty.  Only one process
+ * may take strings out.
+ */
+bool shm_ring_peek(shm_ring_t *ring, char *buf);
+
+/* Hand slot read by shm_ring_peek back to producers */
+void shm_ring_release(shm_ring_t *ring);
+
+/* Strings pushed and not yet taken */
+size_t shm_ring_count(shm_ring_t *ring);
+
+#endif /* LAB0_SHMRING_H */
@@ -0,0 +1,264 @@
+/* Binary command protocol over Unix domain sockets */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "sock.h"
+
+#define LISTENQ 1024
+#define READ_CHUNK 65536 /* least room offered to each read() */
+#define BATCH_IOV 256    /* vectors handed to each sendmsg() */
+
+/* A client hanging up must not raise SIGPIPE in the interpreter */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 /* SO_NOSIGPIPE is set on each socket instead */
+#endif
+
+/* Header and argument length of reply, ahead of its text */
+typedef struct {
+    sock_hdr_t hdr;
+    uint32_t arglen;
+} sock_reply_t;
+
+static const char *op_names[SOCK_NOPS] = {
+    [SOCK_OP_NEW] = "new",   [SOCK_OP_FREE] = "free", [SOCK_OP_IH] = "ih",
+    [SOCK_OP_IT] = "it",     [SOCK_OP_RH] = "rh",     [SOCK_OP_RT] = "rt",
+    [SOCK_OP_SIZE] = "size", [SOCK_OP_SHOW] = "show", [SOCK_OP_SORT] = "sort",
+    [SOCK_OP_REVERSE] = "reverse",
+};
+
+const char *sock_op_name(int op)
+{
+    return op >= 0 && op < SOCK_NOPS ? op_names[op] : NULL;
+}
+
+int sock_open(const char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+
+    int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenfd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    /* Socket file left by an earlier run would make bind fail */
+    unlink(path);
+    if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(listenfd, LISTENQ) < 0 || set_nonblocking(listenfd, true) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+int sock_accept(int listenfd)
+{
+    int connfd = accept(listenfd, NULL, NULL);
+    if (connfd < 0)
+        return -1;
+    if (set_nonblocking(connfd, true) < 0) {
+        close(connfd);
+        return -1;
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(connfd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    return connfd;
+}
+
+void sock_conn_init(sock_conn_t *conn, int fd)
+{
+    memset(conn, 0, sizeof(sock_conn_t));
+    conn->fd = fd;
+}
+
+void sock_conn_free(sock_conn_t *conn)
+{
+    web_buf_free(&conn->in);
+    web_buf_free(&conn->args);
+    web_buf_free(&conn->replies);
+    web_buf_free(&conn->bodies);
+    web_buf_free(&conn->out);
+}
+
+int sock_conn_read(sock_conn_t *conn)
+{
+    web_buf_t *in = &conn->in;
+    if (conn->in_pos == in->len) {
+        in->len = conn->in_pos = 0;
+    } else if (conn->in_pos > in->cap / 2) {
+        /* Move partial frame to front */
+        memmove(in->data, in->data + conn->in_pos, in->len - conn->in_pos);
+        in->len -= conn->in_pos;
+        conn->in_pos = 0;
+    }
+
+    for (;;) {
+        if (in->len - conn->in_pos >= SOCK_FRAME_MAX + sizeof(sock_hdr_t))
+            return 0; /* enough buffered; take frames first */
+        if (!web_buf_reserve(in, READ_CHUNK))
+            return -1;
+        ssize_t n = read(conn->fd, in->data + in->len, in->cap - in->len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (n == 0) {
+            conn->eof = true;
+            return 0;
+        }
+        in->len += n;
+    }
+}
+
+int sock_conn_next(sock_conn_t *conn,
+                   sock_hdr_t *hdr,
+                   char *argv[],
+                   int maxargs)
+{
+    size_t avail = conn->in.len - conn->in_pos;
+    if (avail < sizeof(sock_hdr_t))
+        return 0;
+    const char *start = conn->in.data + conn->in_pos;
+    memcpy(hdr, start, sizeof(sock_hdr_t));
+    if (hdr->len > SOCK_FRAME_MAX || hdr->argc > maxargs)
+        return -1;
+    if (avail < sizeof(sock_hdr_t) + hdr->len)
+        return 0;
+
+    /* Copy arguments out, so that each can be null-terminated */
+    const char *p = start + sizeof(sock_hdr_t);
+    const char *end = p + hdr->len;
+    size_t offset[UINT8_MAX + 1];
+    conn->args.len = 0;
+    for (int i = 0; i < hdr->argc; i++) {
+        uint32_t len;
+        if (end - p < sizeof(len))
+            return -1;
+        memcpy(&len, p, sizeof(len));
+        p += sizeof(len);
+        if (len > end - p)
+            return -1;
+        offset[i] = conn->args.len;
+        if (!web_buf_append(&conn->args, p, len) ||
+            !web_buf_append(&conn->args, "", 1))
+            return -1;
+        p += len;
+    }
+    if (p != end)
+        return -1;
+
+    for (int i = 0; i < hdr->argc; i++)
+        argv[i] = conn->args.data + offset[i];
+    conn->in_pos += sizeof(sock_hdr_t) + hdr->len;
+    return 1;
+}
+
+bool sock_conn_reply(sock_conn_t *conn,
+                     const sock_hdr_t *req,
+                     bool ok,
+                     const char *text,
+                     size_t len)
+{
+    sock_reply_t reply = {
+        .hdr =
+            {
+                .len = sizeof(uint32_t) + len,
+                .queue = req->queue,
+                .op = ok ? SOCK_OK : SOCK_ERROR,
+                .argc = 1,
+            },
+        .arglen = len,
+    };
+    return web_buf_append(&conn->replies, (char *) &reply, sizeof(reply)) &&
+           web_buf_append(&conn->bodies, text, len);
+}
+
+/* Write out what is left of earlier batches */
+static int flush_out(sock_conn_t *conn)
+{
+    web_buf_t *out = &conn->out;
+    while (conn->out_pos < out->len) {
+        ssize_t n = send(conn->fd, out->data + conn->out_pos,
+                         out->len - conn->out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        conn->out_pos += n;
+    }
+    out->len = conn->out_pos = 0;
+    return 1;
+}
+
+int sock_conn_flush(sock_conn_t *conn)
+{
+    sock_reply_t *replies = (sock_reply_t *) conn->replies.data;
+    size_t nreplies = conn->replies.len / sizeof(sock_reply_t);
+    size_t next = 0; /* Next reply to gather */
+    size_t body = 0; /* Offset of its text */
+
+    int status = flush_out(conn);
+    if (status < 0)
+        return -1;
+    /* Once the socket is full, the rest is kept in out */
+    bool saving = status == 0;
+
+    while (next < nreplies) {
+        struct iovec iov[BATCH_IOV];
+        int cnt = 0;
+        size_t total = 0;
+        while (next < nreplies && cnt + 2 <= BATCH_IOV) {
+            iov[cnt].iov_base = &replies[next];
+            iov[cnt++].iov_len = sizeof(sock_reply_t);
+            total += sizeof(sock_reply_t);
+            if (replies[next].arglen) {
+                iov[cnt].iov_base = conn->bodies.data + body;
+                iov[cnt++].iov_len = replies[next].arglen;
+                total += replies[next].arglen;
+                body += replies[next].arglen;
+            }
+            next++;
+        }
+
+        ssize_t n = 0;
+        if (!saving) {
+            struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
+            do
+                n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+            while (n < 0 && errno == EINTR);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            if (n < 0)
+                n = 0;
+        }
+        if (n < total) {
+            /* Keep bytes the socket did not take, in order */
+            saving = true;
+            for (int i = 0; i < cnt; i++) {
+                size_t len = iov[i].iov_len;
+                size_t skip = (size_t) n < len ? (size_t) n : len;
+                n -= skip;
+                if (!web_buf_append(&conn->out,
+                                    (char *) iov[i].iov_base + skip,
+                                    len - skip))
+                    return -1;
+            }
+        }
+    }
+
+    conn->replies.len = conn->bodies.len = 0;
+    return saving ? 0 : 1;
+}
@@ -0,0 +1,104 @@
+#ifndef LAB0_SOCK_H
+#define LAB0_SOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "web.h"
+
+/* Binary command protocol over Unix domain sockets.
+ *
+ * Requests and replies are frames of the same layout: a sock_hdr_t, then
+ * argc arguments, each a uint32_t length followed by that many bytes.
+ * Integers are in host byte order, since both ends are on one machine.
+ *
+ * A request names its command by opcode, or with SOCK_OP_CMD by its first
+ * argument, and is run on the queue given by id.  Its reply carries the
+ * same queue id, SOCK_OK or SOCK_ERROR as op, and the command's output as
+ * single argument.  Requests may be sent without waiting for replies, which
+ * come back in order.
+ */
+
+typedef struct {
+    uint32_t len;   /* Bytes of arguments following header */
+    uint16_t queue; /* Queue id, or SOCK_CURRENT */
+    uint8_t op;     /* Opcode of request, status of reply */
+    uint8_t argc;   /* Number of arguments */
+} sock_hdr_t;
+
+enum {
+    SOCK_OP_CMD, /* Command given by name in first argument */
+    SOCK_OP_NEW,
+    SOCK_OP_FREE,
+    SOCK_OP_IH,
+    SOCK_OP_IT,
+    SOCK_OP_RH,
+    SOCK_OP_RT,
+    SOCK_OP_SIZE,
+    SOCK_OP_SHOW,
+    SOCK_OP_SORT,
+    SOCK_OP_REVERSE,
+    SOCK_NOPS
+};
+
+#define SOCK_OK 0
+#define SOCK_ERROR 1
+
+/* Queue id meaning whichever queue is current */
+#define SOCK_CURRENT 0xffff
+
+/* Largest request accepted */
+#define SOCK_FRAME_MAX (1 << 20)
+
+/* Connection, read and written without blocking */
+typedef struct {
+    int fd;
+    web_buf_t in;      /* Bytes received */
+    size_t in_pos;     /* Start of first frame not yet taken */
+    web_buf_t args;    /* Arguments of current request, null-terminated */
+    web_buf_t replies; /* Reply headers of batch, as sock_reply_t */
+    web_buf_t bodies;  /* Reply texts of batch */
+    web_buf_t out;     /* Bytes the socket did not take */
+    size_t out_pos;    /* Bytes of out already written */
+    bool eof;          /* Client has finished sending */
+} sock_conn_t;
+
+/* Command name of opcode, or NULL if not known */
+const char *sock_op_name(int op);
+
+/* Create listening socket at path, replacing any stale socket file */
+int sock_open(const char *path);
+
+/* Accept connection, set nonblocking.  Return -1 if none is waiting */
+int sock_accept(int listenfd);
+
+void sock_conn_init(sock_conn_t *conn, int fd);
+
+/* Release buffers of connection.  Does not close it */
+void sock_conn_free(sock_conn_t *conn);
+
+/* Read everything that has arrived.  Return 0, or -1 on error */
+int sock_conn_read(sock_conn_t *conn);
+
+/* Take next complete request, storing its header and up to maxargs
+ * arguments as null-terminated strings.  Return 1 if one was taken, 0 if
+ * none is complete, or -1 if the input is not a valid frame.
+ */
+int sock_conn_next(sock_conn_t *conn,
+                   sock_hdr_t *hdr,
+                   char *argv[],
+                   int maxargs);
+
+/* Add reply to batch.  Return false if out of memory */
+bool sock_conn_reply(sock_conn_t *conn,
+                     const sock_hdr_t *req,
+                     bool ok,
+                     const char *text,
+                     size_t len);
+
+/* Write batch of replies with sendmsg, and anything left from before.
+ * Return 1 when all are written, 0 if the socket is full, -1 on error.
+ */
+int sock_conn_flush(sock_conn_t *conn);
+
+#endif /* LAB0_SOCK_H */
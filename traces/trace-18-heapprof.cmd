@@ -0,0 +1,19 @@
+# Test of heap profile of allocation sites
+option fail 10
+option malloc 0
+heapprof reset
+new
+ih dolphin
+ih bear
+it gerbil
+heapprof
+heapprof 2
+heapprof leaks
+rh bear
+heapprof leaks
+heapprof reset
+heapprof 0
+mustfail heapprof many
+mustfail heapprof 1 2
+free
+heapprof leaks
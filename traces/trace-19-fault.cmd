@@ -0,0 +1,28 @@
+# Test of fault injection schedule restricted to one command
+option fail 10
+option malloc 0
+new
+option malloc_nth 1
+fault cmd it
+fault
+ih dolphin
+it bear
+it gerbil
+rh dolphin
+rh gerbil
+fault off
+option malloc_every 2
+fault cmd ih
+ih bear
+ih meerkat
+it dolphin
+size
+rh dolphin
+fault cmd any
+fault off
+fault
+ih gerbil
+rh gerbil
+mustfail fault on
+mustfail fault cmd
+mustfail fault cmd it extra
@@ -0,0 +1,18 @@
+# Test of time budgets of queue operations
+option fail 10
+option malloc 0
+budget
+option budget 2000
+budget it 500
+budget reverse -1
+budget
+new
+it dolphin
+it bear
+reverse
+rh bear
+mustfail budget it
+mustfail budget it fast
+mustfail budget it 1 2
+budget it -1
+budget
@@ -0,0 +1,23 @@
+# Test of memory accounting and quota of each queue
+option fail 10
+option malloc 0
+mem
+new
+ih dolphin
+ih bear
+new
+it gerbil
+mem
+option qmem 100
+it meerkat
+it bear
+it dolphin
+size
+mem
+rh gerbil
+rh meerkat
+option qmem 0
+mustfail mem all
+free
+free
+mem
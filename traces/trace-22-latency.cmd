@@ -0,0 +1,15 @@
+# Test of latency percentiles of each command
+option fail 10
+option malloc 0
+latency reset
+new
+ih dolphin
+ih bear
+it gerbil
+reverse
+latency
+latency reset
+size
+latency
+mustfail latency clear
+mustfail latency reset now
@@ -0,0 +1,11 @@
+# Test of record of every command, run with -o json
+option fail 10
+option malloc 0
+new
+ih dolphin
+it "bear"
+it gerbil\meerkat
+mustfail rh squirrel
+size
+rt gerbil\meerkat
+free
@@ -0,0 +1,9 @@
+# Test of compiling command files into programs
+option fail 10
+option malloc 0
+compile traces/trace-25-program.cmd /tmp/qtest.trace.qtb
+compile traces/trace-01-ops.cmd /tmp/qtest.trace.qtb
+mustfail compile traces/trace-26-repeat.cmd /tmp/qtest.trace.qtb
+mustfail compile traces/no-such-trace.cmd /tmp/qtest.trace.qtb
+mustfail compile traces/trace-25-program.cmd /no-such-dir/trace.qtb
+mustfail compile traces/trace-25-program.cmd
@@ -0,0 +1,14 @@
+# Test of programs, compiled and then run with -b
+option fail 10
+option malloc 0
+new
+ih dolphin
+ih bear
+it gerbil
+reverse
+size
+rh gerbil
+source traces/trace-01-ops.cmd
+new
+it meerkat
+rh meerkat
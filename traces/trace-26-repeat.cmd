@@ -0,0 +1,30 @@
+# Test of loops and variables
+option fail 10
+option malloc 0
+new
+set n 4
+set m $n * 2
+repeat i 1..$n {
+it $i
+}
+repeat $m {
+ih x
+}
+size
+repeat i $n {
+set m $m - 1
+rh x
+}
+set
+size
+repeat i 1..2 {
+repeat j 2 {
+rt $n
+set n $n - 1
+}
+}
+size
+mustfail set x
+mustfail set x 1 / 0
+mustfail set x 1 ^ 2
+mustfail set x one
@@ -0,0 +1,30 @@
+# Test of benchmarking commands on a restored queue
+option fail 10
+option malloc 0
+mustfail bench -n 3 it dolphin
+new
+ih dolphin
+ih bear
+it gerbil
+bench -w 2 -n 5 reverse
+bench -n 3 it meerkat
+bench -w 0 -n 1 rh bear
+size
+rh bear
+rh dolphin
+rh gerbil
+mustfail bench
+mustfail bench -n 0 reverse
+mustfail bench -n -1 reverse
+mustfail bench -x 3 reverse
+mustfail bench -n 3
+mustfail bench no-such-command
+mustfail bench -n 2 rh squirrel
+mustfail bench -n 2 new
+free
+mustfail bench -n 1 size
+new
+ih lemur
+mustfail bench -w 0 -n 1 free
+rh lemur
+free
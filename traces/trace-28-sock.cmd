@@ -0,0 +1,10 @@
+# Test of binary protocol socket setup
+option fail 10
+option malloc 0
+mustfail sock
+mustfail sock /no-such-dir/qtest.sock
+sock /tmp/qtest.trace.sock
+mustfail sock /tmp/qtest.trace.sock
+new
+ih dolphin
+rh dolphin
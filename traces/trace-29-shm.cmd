@@ -0,0 +1,23 @@
+# Test of shared-memory rings
+option fail 10
+option malloc 0
+new
+mustfail shmdrain
+shmcreate /qtest-trace 8 16
+shmdrain
+shmdrain 4
+size
+shmcreate /qtest-trace
+shmdrain
+mustfail shmcreate
+mustfail shmcreate /qtest-trace 6
+mustfail shmcreate /qtest-trace 0
+mustfail shmcreate /qtest-trace 8 1
+mustfail shmcreate /qtest-trace 8 16 extra
+mustfail shmdrain -1
+mustfail shmdrain 1 2
+mustfail shmattach
+mustfail shmattach /qtest-trace extra
+mustfail shmattach /qtest-no-such-ring
+mustfail shmdrain
+free
@@ -0,0 +1,14 @@
+# Test of work-stealing deque benchmark
+option fail 10
+option malloc 0
+wsbench -t 1 -d 4 -w 10
+wsbench -t 4 -d 10 -w 10
+wsbench -t 2 -d 0 -w 0
+mustfail wsbench -t 0
+mustfail wsbench -t 257
+mustfail wsbench -d 31
+mustfail wsbench -d -1
+mustfail wsbench -w -1
+mustfail wsbench -x 1
+mustfail wsbench -t
+mustfail wsbench 4
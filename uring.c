@@ -0,0 +1,193 @@
+/* Minimal io_uring interface, on the raw system calls */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static int setup(unsigned entries, struct io_uring_params *p, unsigned flags)
+{
+    memset(p, 0, sizeof(*p));
+    p->flags = flags;
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+bool uring_init(uring_t *ring, unsigned entries)
+{
+    memset(ring, 0, sizeof(uring_t));
+    struct io_uring_params p;
+    /* Only this thread submits, and it needs no interrupt to reap */
+    ring->fd = setup(entries, &p,
+                     IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+    if (ring->fd < 0 && errno == EINVAL)
+        ring->fd = setup(entries, &p, 0);
+    if (ring->fd < 0)
+        return false;
+
+    ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_len =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_map_len > ring->sq_map_len)
+        ring->sq_map_len = ring->cq_map_len;
+
+    ring->sq_map =
+        mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+        goto fail_sq;
+    ring->cq_map = single ? ring->sq_map
+                          : mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, ring->fd,
+                                 IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED)
+        goto fail_cq;
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail_sqes;
+
+    char *sq = ring->sq_map, *cq = ring->cq_map;
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    /* Entries are used in ring order, so the index array never changes */
+    unsigned *array = (unsigned *) (sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+    return true;
+
+fail_sqes:
+    if (!single)
+        munmap(ring->cq_map, ring->cq_map_len);
+fail_cq:
+    munmap(ring->sq_map, ring->sq_map_len);
+fail_sq:
+    close(ring->fd);
+    return false;
+}
+
+void uring_exit(uring_t *ring)
+{
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_len);
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+    if (ring->sqe_tail - load_acquire(ring->sq_head) >= ring->sq_entries &&
+        (uring_submit(ring, 0) < 0 ||
+         ring->sqe_tail - load_acquire(ring->sq_head) >= ring->sq_entries))
+        return NULL;
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqe_tail++;
+    return sqe;
+}
+
+int uring_submit(uring_t *ring, unsigned wait_nr)
+{
+    store_release(ring->sq_tail, ring->sqe_tail);
+    unsigned pending = ring->sqe_tail - load_acquire(ring->sq_head);
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    if (!pending && !wait_nr)
+        return 0;
+    int n;
+    do
+        n = syscall(__NR_io_uring_enter, ring->fd, pending, wait_nr, flags,
+                    NULL, 0);
+    while (n < 0 && errno == EINTR && !wait_nr);
+    return n;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == load_acquire(ring->cq_tail))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring)
+{
+    store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+bool uring_bufs_init(uring_t *ring,
+                     uring_bufs_t *bufs,
+                     unsigned short group,
+                     unsigned count,
+                     unsigned size)
+{
+    memset(bufs, 0, sizeof(uring_bufs_t));
+    bufs->ring_len = count * sizeof(struct io_uring_buf);
+    /* Ring must be page aligned */
+    bufs->ring = mmap(NULL, bufs->ring_len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs->ring == MAP_FAILED)
+        return false;
+    bufs->data = malloc((size_t) count * size);
+    if (!bufs->data) {
+        munmap(bufs->ring, bufs->ring_len);
+        return false;
+    }
+    bufs->count = count;
+    bufs->size = size;
+    bufs->group = group;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (unsigned long) bufs->ring,
+        .ring_entries = count,
+        .bgid = group,
+    };
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0) {
+        free(bufs->data);
+        munmap(bufs->ring, bufs->ring_len);
+        return false;
+    }
+    for (unsigned i = 0; i < count; i++)
+        uring_buf_put(bufs, i);
+    return true;
+}
+
+void uring_bufs_free(uring_bufs_t *bufs)
+{
+    free(bufs->data);
+    munmap(bufs->ring, bufs->ring_len);
+}
+
+char *uring_buf(uring_bufs_t *bufs, unsigned id)
+{
+    return bufs->data + (size_t) id * bufs->size;
+}
+
+void uring_buf_put(uring_bufs_t *bufs, unsigned id)
+{
+    /* Tail shares its place with the reserved field of the first entry */
+    unsigned slot = bufs->tail & (bufs->count - 1);
+    struct io_uring_buf *buf = &bufs->ring->bufs[slot];
+    buf->addr = (unsigned long) uring_buf(bufs, id);
+    buf->len = bufs->size;
+    buf->bid = id;
+    bufs->tail++;
+    store_release(&bufs->ring->tail, bufs->tail);
+}
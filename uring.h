@@ -0,0 +1,83 @@
+#ifndef LAB0_URING_H
+#define LAB0_URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Minimal io_uring interface, on the raw system calls.
+ *
+ * A ring belongs to the thread that set it up.  Entries taken with
+ * uring_get_sqe are handed to the kernel by the next uring_submit, together
+ * with waiting for completions, so that a whole batch of I/O costs a single
+ * system call.
+ */
+
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail; /* Entries taken, not all published to kernel */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+} uring_t;
+
+/* Buffers provided to the kernel, which picks one for each receive */
+typedef struct {
+    struct io_uring_buf_ring *ring;
+    size_t ring_len;
+    char *data;
+    unsigned count; /* Power of 2 */
+    unsigned size;  /* Bytes of each buffer */
+    unsigned short group;
+    unsigned short tail;
+} uring_bufs_t;
+
+/* Set up ring with room for entries submissions.  Return false if the
+ * kernel does not support io_uring or it is disabled.
+ */
+bool uring_init(uring_t *ring, unsigned entries);
+
+void uring_exit(uring_t *ring);
+
+/* Take cleared submission entry, submitting earlier ones if it is full */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/* Submit entries taken and wait for at least wait_nr completions.
+ * Return number submitted, or -1 with errno set.
+ */
+int uring_submit(uring_t *ring, unsigned wait_nr);
+
+/* Next completion, or NULL if there is none */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+
+/* Release completion returned by uring_peek_cqe */
+void uring_cqe_seen(uring_t *ring);
+
+/* Register count buffers of size bytes as buffer group */
+bool uring_bufs_init(uring_t *ring,
+                     uring_bufs_t *bufs,
+                     unsigned short group,
+                     unsigned count,
+                     unsigned size);
+
+/* Free buffers, once the ring they were registered with is torn down */
+void uring_bufs_free(uring_bufs_t *bufs);
+
+/* Address of buffer the kernel picked */
+char *uring_buf(uring_bufs_t *bufs, unsigned id);
+
+/* Give buffer back to the kernel once its data is consumed */
+void uring_buf_put(uring_bufs_t *bufs, unsigned id);
+
+#endif /* LAB0_URING_H */
@@ -4,16 +4,39 @@
 
 #include <arpa/inet.h> /* inet_ntoa */
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "poller.h"
+#include "web.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#ifdef USE_IO_URING
+#include "uring.h"
+#endif
 
 #define LISTENQ 1024 /* second argument to listen() */
 #define MAXLINE 1024 /* max length of a line */
 #define BUFSIZE 1024
+#define READ_CHUNK 16384 /* least room offered to each read() */
+#define FILE_CHUNK 65536 /* most of file copied at once into out */
+#define BODY_CHUNK 65536 /* output beyond this is sent in chunks */
 
 #ifndef DEFAULT_PORT
 #define DEFAULT_PORT 9999 /* use this port if none given as arg to main() */
@@ -23,57 +46,20 @@
 #define TCP_CORK TCP_NOPUSH
 #endif
 
-typedef struct {
-    int fd;            /* descriptor for this buf */
-    int count;         /* unread byte in this buf */
-    char *bufptr;      /* next unread byte in this buf */
-    char buf[BUFSIZE]; /* internal buffer */
-} rio_t;
+/* Longest request, header and body, accepted on a connection */
+#define REQUEST_MAX (1 << 20)
 
 typedef struct {
     char filename[512];
     off_t offset; /* for support Range */
     size_t end;
+    size_t content_length;
+    bool keep_alive;
+    bool http11;
+    bool post;
+    int error; /* Status to refuse request with, or 0 */
 } http_request_t;
 
-static void rio_readinitb(rio_t *rp, int fd)
-{
-    rp->fd = fd;
-    rp->count = 0;
-    rp->bufptr = rp->buf;
-}
-
-/* This is a wrapper for the Unix read() function that transfers min(n, count)
- * bytes from an internal buffer to a user buffer, where n is the number of
- * bytes requested by the user and count is the number of unread bytes in the
- * internal buffer. On entry, rio_read() refills the internal buffer via a call
- * to read() if the internal buffer is empty.
- */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
-{
-    int cnt;
-    while (rp->count <= 0) { /* refill if buf is empty */
-        rp->count = read(rp->fd, rp->buf, sizeof(rp->buf));
-        if (rp->count < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
-                return -1;
-        } else if (rp->count == 0) { /* EOF */
-            return 0;
-        } else
-            rp->bufptr = rp->buf; /* reset buffer ptr */
-    }
-
-    /* Copy min(n, rp->count) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->count < n)
-        cnt = rp->count;
-    memcpy(usrbuf, rp->bufptr, cnt);
-    rp->bufptr += cnt;
-    rp->count -= cnt;
-    return cnt;
-}
-
 static ssize_t writen(int fd, void *usrbuf, size_t n)
 {
     size_t nleft = n;
@@ -93,32 +79,18 @@ static ssize_t writen(int fd, void *usrbuf, size_t n)
     return n;
 }
 
-/* robustly read a text line (buffered) */
-static ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+void web_send(int out_fd, char *buf)
 {
-    char c, *bufp = usrbuf;
-
-    int n;
-    for (n = 1; n < maxlen; n++) {
-        int rc;
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            break;        /* EOF, some data was read */
-        } else
-            return -1; /* error */
-    }
-    *bufp = 0;
-    return n;
+    writen(out_fd, buf, strlen(buf));
 }
 
-void web_send(int out_fd, char *buf)
+int set_nonblocking(int fd, bool on)
 {
-    writen(out_fd, buf, strlen(buf));
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        return -1;
+    flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
 }
 
 int web_open(int port)
@@ -153,15 +125,34 @@ int web_open(int port)
     /* Make it a listening socket ready to accept connection requests */
     if (listen(listenfd, LISTENQ) < 0)
         return -1;
+
+    /* Connections are accepted as they arrive, never waited for */
+    if (set_nonblocking(listenfd, true) < 0)
+        return -1;
     return listenfd;
 }
 
-static void url_decode(char *src, char *dest, int max)
+int web_accept(int listenfd)
+{
+    struct sockaddr_in clientaddr;
+    socklen_t clientlen = sizeof(clientaddr);
+    int connfd = accept(listenfd, (struct sockaddr *) &clientaddr, &clientlen);
+    if (connfd < 0)
+        return -1;
+    if (set_nonblocking(connfd, true) < 0) {
+        close(connfd);
+        return -1;
+    }
+    return connfd;
+}
+
+/* Decode len bytes of URL into dest, which has room for max bytes */
+static void url_decode(const char *src, size_t len, char *dest, int max)
 {
-    char *p = src;
+    const char *p = src, *end = src + len;
     char code[3] = {0};
-    while (*p && --max) {
-        if (*p == '%') {
+    while (p < end && --max) {
+        if (*p == '%' && end - p >= 3) {
             memcpy(code, ++p, 2);
             *dest++ = (char) strtoul(code, NULL, 16);
             p += 2;
@@ -172,49 +163,297 @@ static void url_decode(char *src, char *dest, int max)
     *dest = '\0';
 }
 
-static void parse_request(int fd, http_request_t *req)
+/* Find first '\n' in [p, end), comparing a vector of bytes at once */
+static const char *find_newline(const char *p, const char *end)
 {
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
+#ifdef __AVX2__
+    const __m256i nl32 = _mm256_set1_epi8('\n');
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl32));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+    return memchr(p, '\n', end - p);
+}
+
+/* Take next blank-separated word of line, and return its length */
+static size_t next_word(const char **p, const char *end, const char **word)
+{
+    const char *s = *p;
+    while (s < end && (*s == ' ' || *s == '\t'))
+        s++;
+    *word = s;
+    while (s < end && *s != ' ' && *s != '\t')
+        s++;
+    *p = s;
+    return s - *word;
+}
+
+static bool has_prefix(const char *line, size_t len, const char *prefix)
+{
+    size_t n = strlen(prefix);
+    return len >= n && !strncasecmp(line, prefix, n);
+}
+
+/* Parse request header in place, straight from the receive buffer.
+ * Return length of header, or 0 if it has not arrived in full.
+ */
+static size_t parse_request(const char *text, size_t len, http_request_t *req)
+{
+    const char *end = text + len;
     req->offset = 0;
     req->end = 0; /* default */
+    req->content_length = 0;
+    req->error = 0;
+    req->filename[0] = '\0';
 
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%lu-%lu", (unsigned long *) &req->offset,
-                   (unsigned long *) &req->end);
-            /* Range: [start, end] */
-            if (req->end != 0)
-                req->end++;
-        }
-    }
-    char *filename = uri;
-    if (uri[0] == '/') {
-        filename = uri + 1;
-        int length = strlen(filename);
-        if (length == 0) {
-            filename = ".";
-        } else {
-            for (int i = 0; i < length; ++i) {
-                if (filename[i] == '?') {
-                    filename[i] = '\0';
-                    break;
+    /* Request line */
+    const char *nl = find_newline(text, end);
+    if (!nl)
+        return 0;
+    const char *p = text, *method, *uri, *version;
+    const char *line_end = nl > text && nl[-1] == '\r' ? nl - 1 : nl;
+    size_t method_len = next_word(&p, line_end, &method);
+    req->post = method_len == 4 && !strncmp(method, "POST", 4);
+    size_t uri_len = next_word(&p, line_end, &uri);
+    size_t version_len = next_word(&p, line_end, &version);
+    /* Connections persist from HTTP/1.1 on, unless told otherwise */
+    req->http11 =
+        version_len && (version_len != 8 || strncmp(version, "HTTP/1.0", 8));
+    req->keep_alive = req->http11;
+
+    /* Header fields, up to blank line.  Only their first letter is looked
+     * at, unless it is that of a field of interest.
+     */
+    for (;;) {
+        const char *line = nl + 1;
+        nl = find_newline(line, end);
+        if (!nl)
+            return 0;
+        size_t n = (nl > line && nl[-1] == '\r' ? nl - 1 : nl) - line;
+        if (!n)
+            break;
+        switch (line[0] | 0x20) {
+        case 'c':
+            if (has_prefix(line, n, "Content-Length:")) {
+                char *digits_end;
+                errno = 0;
+                unsigned long long cl = strtoull(line + 15, &digits_end, 10);
+                if (digits_end == line + 15)
+                    req->error = 400;
+                else if (errno || cl > REQUEST_MAX)
+                    req->error = 413;
+                else
+                    req->content_length = cl;
+            } else if (has_prefix(line, n, "Connection:")) {
+                const char *value = line + 11;
+                size_t vlen = n - 11;
+                while (vlen && *value == ' ') {
+                    value++;
+                    vlen--;
                 }
+                if (has_prefix(value, vlen, "close"))
+                    req->keep_alive = false;
+                else if (has_prefix(value, vlen, "keep-alive"))
+                    req->keep_alive = true;
             }
+            break;
+        case 'r':
+            if (n > 13 && !strncmp(line, "Range: bytes=", 13)) {
+                char *dash;
+                req->offset = strtoul(line + 13, &dash, 10);
+                if (*dash == '-')
+                    req->end = strtoul(dash + 1, NULL, 10);
+                /* Range: [start, end] */
+                if (req->end != 0)
+                    req->end++;
+            }
+            break;
         }
     }
-    url_decode(filename, req->filename, MAXLINE);
+
+    if (uri_len && uri[0] == '/') {
+        uri++;
+        uri_len--;
+        const char *query = memchr(uri, '?', uri_len);
+        if (query)
+            uri_len = query - uri;
+        if (!uri_len) {
+            uri = ".";
+            uri_len = 1;
+        }
+    }
+    url_decode(uri, uri_len, req->filename, sizeof(req->filename));
+
+    size_t header = nl + 1 - text;
+    /* Body must fit in what a connection buffers */
+    if (!req->error && req->content_length > REQUEST_MAX - header)
+        req->error = 413;
+    if (req->error) {
+        req->content_length = 0;
+        req->keep_alive = false;
+    }
+    return header;
+}
+
+bool web_buf_reserve(web_buf_t *buf, size_t n)
+{
+    if (buf->len + n <= buf->cap)
+        return true;
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + n)
+        cap *= 2;
+    char *data = realloc(buf->data, cap);
+    if (!data)
+        return false;
+    buf->data = data;
+    buf->cap = cap;
+    return true;
+}
+
+bool web_buf_append(web_buf_t *buf, const char *data, size_t len)
+{
+    if (!web_buf_reserve(buf, len))
+        return false;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+bool web_buf_vprintf(web_buf_t *buf, const char *fmt, va_list ap)
+{
+    va_list copy;
+    va_copy(copy, ap);
+    int n = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    if (n < 0 || !web_buf_reserve(buf, n + 1))
+        return false;
+    vsnprintf(buf->data + buf->len, n + 1, fmt, ap);
+    buf->len += n;
+    return true;
+}
+
+void web_buf_free(web_buf_t *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+}
+
+void web_conn_init(web_conn_t *conn, int fd)
+{
+    memset(conn, 0, sizeof(web_conn_t));
+    conn->fd = fd;
+    conn->keep_alive = true;
+    conn->file_fd = -1;
 }
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr)
+void web_conn_free(web_conn_t *conn)
 {
+    web_buf_free(&conn->in);
+    web_buf_free(&conn->out);
+    if (conn->file_fd >= 0)
+        close(conn->file_fd);
+    conn->file_fd = -1;
+}
+
+/* Whether first request buffered has arrived in full, or can be refused.
+ * parse_request keeps content_length within REQUEST_MAX.
+ */
+static bool request_complete(web_conn_t *conn)
+{
+    size_t avail = conn->in.len - conn->in_pos;
     http_request_t req;
-    parse_request(fd, &req);
+    size_t header = parse_request(conn->in.data + conn->in_pos, avail, &req);
+    return header && req.content_length <= avail - header;
+}
+
+/* Reclaim room taken by requests already served */
+static void compact_input(web_conn_t *conn)
+{
+    web_buf_t *in = &conn->in;
+    if (conn->in_pos == in->len) {
+        in->len = conn->in_pos = 0;
+    } else if (conn->in_pos > in->cap / 2) {
+        /* Move partial request to front */
+        memmove(in->data, in->data + conn->in_pos, in->len - conn->in_pos);
+        in->len -= conn->in_pos;
+        in->data[in->len] = '\0';
+        conn->in_pos = 0;
+    }
+}
+
+int web_conn_read(web_conn_t *conn)
+{
+    web_buf_t *in = &conn->in;
+    compact_input(conn);
+    for (;;) {
+        /* Take pipelined requests first, but refuse one too large */
+        if (in->len - conn->in_pos >= REQUEST_MAX)
+            return request_complete(conn) ? 0 : -1;
+        /* Keep one byte for terminating null */
+        if (!web_buf_reserve(in, READ_CHUNK + 1))
+            return -1;
+        ssize_t n = read(conn->fd, in->data + in->len, in->cap - in->len - 1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (n == 0) {
+            conn->eof = true;
+            return 0;
+        }
+        in->len += n;
+        in->data[in->len] = '\0';
+    }
+}
+
+char *web_conn_next(web_conn_t *conn)
+{
+    if (conn->in_pos == conn->in.len)
+        return NULL;
+    size_t avail = conn->in.len - conn->in_pos;
+    http_request_t req;
+    size_t size = parse_request(conn->in.data + conn->in_pos, avail, &req);
+    if (!size)
+        return NULL;
+    const char *body = conn->in.data + conn->in_pos + size;
+    if (req.content_length > avail - size)
+        return NULL; /* body still to come */
+    size += req.content_length;
+    conn->in_pos += size;
+    conn->keep_alive = req.keep_alive;
+    conn->http11 = req.http11;
+
+    /* Nothing after a refused request can be trusted to be one */
+    conn->error = req.error;
+    if (conn->error) {
+        conn->in_pos = conn->in.len;
+        return NULL;
+    }
+
+    /* Body of POST holds commands, one per line */
+    conn->batch = req.post && req.content_length;
+    if (conn->batch) {
+        char *ret = malloc(req.content_length + 1);
+        if (ret) {
+            memcpy(ret, body, req.content_length);
+            ret[req.content_length] = '\0';
+        }
+        return ret;
+    }
 
     char *p = req.filename;
     /* Change '/' to ' ' */
@@ -228,3 +467,827 @@ char *web_recv(int fd, struct sockaddr_in *clientaddr)
 
     return ret;
 }
+
+bool web_conn_refuse(web_conn_t *conn, int status)
+{
+    const char *reason = status == 413 ? "Payload Too Large" : "Bad Request";
+    char header[MAXLINE];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n"
+                     "Connection: close\r\n\r\n",
+                     status, reason);
+    conn->keep_alive = false;
+    return web_buf_append(&conn->out, header, n);
+}
+
+bool web_conn_respond(web_conn_t *conn, const char *body, size_t len)
+{
+    char header[MAXLINE];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                     "Content-Length: %zu\r\n%s\r\n",
+                     len, conn->keep_alive ? "" : "Connection: close\r\n");
+    return web_buf_append(&conn->out, header, n) &&
+           web_buf_append(&conn->out, body, len);
+}
+
+static bool append_chunk(web_conn_t *conn, const char *data, size_t len)
+{
+    char size[32];
+    int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+    return web_buf_append(&conn->out, size, n) &&
+           web_buf_append(&conn->out, data, len) &&
+           web_buf_append(&conn->out, "\r\n", 2);
+}
+
+bool web_conn_output(web_conn_t *conn, const char *data, size_t len)
+{
+    if (!conn->chunked) {
+        char header[MAXLINE];
+        int n = snprintf(header, sizeof(header),
+                         "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                         "Transfer-Encoding: chunked\r\n%s\r\n",
+                         conn->keep_alive ? "" : "Connection: close\r\n");
+        if (!web_buf_append(&conn->out, header, n))
+            return false;
+        conn->chunked = true;
+    }
+    return !len || append_chunk(conn, data, len);
+}
+
+bool web_conn_end(web_conn_t *conn, const char *body, size_t len)
+{
+    if (!conn->chunked)
+        return web_conn_respond(conn, body, len);
+
+    conn->chunked = false;
+    return (!len || append_chunk(conn, body, len)) &&
+           web_buf_append(&conn->out, "0\r\n\r\n", 5);
+}
+
+bool web_conn_send_file(web_conn_t *conn, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+
+    char header[MAXLINE];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                     "Content-Length: %lld\r\n%s\r\n",
+                     (long long) st.st_size,
+                     conn->keep_alive ? "" : "Connection: close\r\n");
+    if (!web_buf_append(&conn->out, header, n)) {
+        close(fd);
+        return false;
+    }
+    conn->file_fd = fd;
+    conn->file_pos = 0;
+    conn->file_end = st.st_size;
+    return true;
+}
+
+/* Copy part of file into out, for when it cannot be sent directly */
+static ssize_t copy_file_chunk(web_conn_t *conn)
+{
+    size_t len = conn->file_end - conn->file_pos;
+    if (len > FILE_CHUNK)
+        len = FILE_CHUNK;
+    if (!web_buf_reserve(&conn->out, len))
+        return -1;
+    ssize_t n = pread(conn->file_fd, conn->out.data + conn->out.len, len,
+                      conn->file_pos);
+    if (n > 0) {
+        conn->out.len += n;
+        conn->file_pos += n;
+    }
+    return n;
+}
+
+/* Send last partial segment, which TCP_CORK would hold back for 200 ms */
+static void uncork(int fd)
+{
+    int off = 0, on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+int web_conn_flush(web_conn_t *conn)
+{
+    web_buf_t *out = &conn->out;
+    if (conn->out_pos == out->len && conn->file_fd < 0)
+        return 1;
+    for (;;) {
+        while (conn->out_pos < out->len) {
+            ssize_t n = write(conn->fd, out->data + conn->out_pos,
+                              out->len - conn->out_pos);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            }
+            conn->out_pos += n;
+        }
+        out->len = conn->out_pos = 0;
+
+        if (conn->file_fd >= 0 && conn->file_pos >= conn->file_end) {
+            close(conn->file_fd);
+            conn->file_fd = -1;
+        }
+        if (conn->file_fd < 0) {
+            uncork(conn->fd);
+            return 1;
+        }
+
+#ifdef __linux__
+        /* File goes from page cache to socket without being copied here */
+        ssize_t n = sendfile(conn->fd, conn->file_fd, &conn->file_pos,
+                             conn->file_end - conn->file_pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+            n = copy_file_chunk(conn);
+#else
+        /* No sendfile, so file is written from out like everything else */
+        ssize_t n = copy_file_chunk(conn);
+#endif
+        if (n <= 0)
+            return -1; /* file shrank or failed: body cannot be completed */
+    }
+}
+
+/* Worker pool.
+ * Workers accept connections, read them and parse requests, each with a
+ * poller of its own.  Parsed requests become jobs on a queue that
+ * only the interpreter thread consumes, so commands never run on a worker
+ * and a slow client never holds up a command.  Finished jobs go back to
+ * the worker owning the connection, which writes the responses in order.
+ */
+#define MAXEVENTS 64
+#define WEB_OUT_MAX (1 << 20) /* stop reading from client this far behind */
+#define PIPELINE_MAX 64       /* jobs of one connection handed over at once */
+
+typedef struct web_worker web_worker_t;
+
+/* Connection served by a worker */
+typedef struct {
+    web_conn_t conn;
+    web_worker_t *worker;
+    web_job_t *ready;      /* Finished jobs not yet in out, in order */
+    web_job_t *ready_tail; /* Last of them */
+    int pending;           /* Requests handed over, not yet answered */
+    bool closing;          /* Request not keeping connection alive taken */
+    bool dead;             /* Socket closed while jobs were pending */
+    int inflight;          /* io_uring operations not yet completed */
+    bool receiving;        /* Receive submitted to io_uring */
+    bool sending;          /* Send of out submitted to io_uring */
+} pool_conn_t;
+
+struct web_worker {
+    pthread_t thread;
+    poller_t *poller;
+    int done_fd[2]; /* Wakeup, readable once jobs are finished */
+    pthread_mutex_t lock;
+    web_job_t *done; /* Finished jobs, guarded by lock */
+    web_job_t *done_tail;
+#ifdef USE_IO_URING
+    uring_t *ring; /* Used instead of poller, if set up */
+    uring_bufs_t *bufs;
+#endif
+};
+
+static web_worker_t *workers = NULL;
+static int nworkers = 0;
+static int pool_listen_fd = -1;
+static atomic_bool pool_stopping = false;
+
+/* Jobs for interpreter, readable on job_fd[0] while there are any */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static web_job_t *job_head = NULL;
+static web_job_t *job_tail = NULL;
+static int job_fd[2] = {-1, -1};
+
+/* Append job to list.  Return true if the list was empty */
+static bool job_append(web_job_t **head, web_job_t **tail, web_job_t *job)
+{
+    bool was_empty = !*head;
+    job->next = NULL;
+    if (was_empty)
+        *head = job;
+    else
+        (*tail)->next = job;
+    *tail = job;
+    return was_empty;
+}
+
+static void job_free(web_job_t *job)
+{
+    free(job->cmd);
+    web_buf_free(&job->body);
+    if (job->file_fd >= 0)
+        close(job->file_fd);
+    free(job);
+}
+
+web_job_t *web_pool_take()
+{
+    pthread_mutex_lock(&job_lock);
+    web_job_t *job = job_head;
+    if (job)
+        job_head = job->next;
+    else
+        wakeup_clear(job_fd); /* With lock held, so no job slips past */
+    pthread_mutex_unlock(&job_lock);
+    return job;
+}
+
+void web_pool_done(web_job_t *job)
+{
+    web_worker_t *w = ((pool_conn_t *) job->conn)->worker;
+    pthread_mutex_lock(&w->lock);
+    bool was_empty = job_append(&w->done, &w->done_tail, job);
+    pthread_mutex_unlock(&w->lock);
+    if (was_empty)
+        wakeup_signal(w->done_fd);
+}
+
+void web_job_output(void *arg, const char *text, size_t len)
+{
+    web_job_t *job = arg;
+    web_buf_append(&job->body, text, len);
+    if (job->body.len < BODY_CHUNK || !job->http11)
+        return;
+
+    /* Output so far goes out ahead of the job, which starts over */
+    web_job_t *part = calloc(1, sizeof(web_job_t));
+    if (!part)
+        return;
+    part->body = job->body;
+    part->file_fd = -1;
+    part->keep_alive = job->keep_alive;
+    part->part = true;
+    part->conn = job->conn;
+    memset(&job->body, 0, sizeof(job->body));
+    web_pool_done(part);
+}
+
+static void submit(web_job_t *job)
+{
+    pthread_mutex_lock(&job_lock);
+    bool was_empty = job_append(&job_head, &job_tail, job);
+    pthread_mutex_unlock(&job_lock);
+    if (was_empty)
+        wakeup_signal(job_fd);
+}
+
+/* Free closed connection once nothing refers to it any more */
+static void pool_conn_release(pool_conn_t *pc)
+{
+    if (pc->pending || pc->inflight)
+        return;
+    web_conn_free(&pc->conn);
+    free(pc);
+}
+
+/* Close socket of connection.  It is freed once no jobs are pending */
+static void pool_conn_close(pool_conn_t *pc)
+{
+    if (!pc->dead) {
+        /* Make operations still with io_uring complete */
+        if (pc->inflight)
+            shutdown(pc->conn.fd, SHUT_RDWR);
+        /* Only epoll forgets a descriptor once it is closed */
+        poller_del(pc->worker->poller, pc->conn.fd);
+        close(pc->conn.fd);
+        pc->dead = true;
+    }
+    web_job_t *job;
+    while ((job = pc->ready)) {
+        pc->ready = job->next;
+        pc->pending -= !job->part;
+        job_free(job);
+    }
+    pool_conn_release(pc);
+}
+
+/* Queue responses of finished jobs, as far as the connection allows.
+ * Return false if out of memory.
+ */
+static bool pool_conn_respond(pool_conn_t *pc)
+{
+    web_conn_t *conn = &pc->conn;
+    web_job_t *job;
+    while ((job = pc->ready) && conn->file_fd < 0 &&
+           conn->out.len < WEB_OUT_MAX) {
+        pc->ready = job->next;
+        pc->pending -= !job->part;
+        /* Respond as the request asked, not as the latest one parsed */
+        conn->keep_alive = job->keep_alive;
+        bool ok;
+        if (job->status) {
+            ok = web_conn_refuse(conn, job->status);
+        } else if (job->file_fd >= 0) {
+            ok = web_conn_send_file(conn, job->file_fd);
+            job->file_fd = -1;
+        } else if (job->part) {
+            ok = web_conn_output(conn, job->body.data, job->body.len);
+        } else {
+            ok = web_conn_end(conn, job->body.data, job->body.len);
+        }
+        job_free(job);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+/* Hand complete requests over to the interpreter, as long as the
+ * connection is not too far behind.  Return false if out of memory.
+ */
+static bool pool_conn_submit(pool_conn_t *pc)
+{
+    web_conn_t *conn = &pc->conn;
+    while (!pc->closing && pc->pending < PIPELINE_MAX) {
+        char *cmd = web_conn_next(conn);
+        if (!cmd && !conn->error)
+            break;
+        web_job_t *job = calloc(1, sizeof(web_job_t));
+        if (!job) {
+            free(cmd);
+            return false;
+        }
+        /* Refusal goes through the interpreter too, to keep its place */
+        job->cmd = cmd;
+        job->status = conn->error;
+        job->file_fd = -1;
+        job->keep_alive = conn->keep_alive;
+        job->http11 = conn->http11;
+        job->batch = conn->batch;
+        job->conn = pc;
+        pc->closing = !conn->keep_alive;
+        pc->pending++;
+        submit(job);
+    }
+    return true;
+}
+
+#ifdef USE_IO_URING
+static void uring_conn_service(pool_conn_t *pc);
+#endif
+
+/* Read, parse and write what connection is ready for */
+static void pool_conn_service(pool_conn_t *pc, uint32_t events)
+{
+    web_conn_t *conn = &pc->conn;
+    if ((events & (POLLIN | POLLHUP | POLLERR)) && !conn->eof &&
+        web_conn_read(conn) < 0) {
+        pool_conn_close(pc);
+        return;
+    }
+
+    int status;
+    do {
+        if (!pool_conn_respond(pc)) {
+            pool_conn_close(pc);
+            return;
+        }
+        status = web_conn_flush(conn);
+        /* Responses held back behind earlier ones can go now */
+    } while (status > 0 && pc->ready);
+    if (status < 0) {
+        pool_conn_close(pc);
+        return;
+    }
+
+    /* Hand over requests, as many as answered ones make room for */
+    if (!pool_conn_submit(pc)) {
+        pool_conn_close(pc);
+        return;
+    }
+
+    /* Anything left after the client stopped sending is incomplete */
+    if (status > 0 && !pc->pending && (pc->closing || conn->eof)) {
+        pool_conn_close(pc);
+        return;
+    }
+
+    uint32_t want = 0;
+    if (status == 0)
+        want |= POLLOUT;
+    if (!conn->eof && !pc->closing && pc->pending < PIPELINE_MAX &&
+        conn->out.len < WEB_OUT_MAX)
+        want |= POLLIN;
+    poller_mod(pc->worker->poller, conn->fd, want, pc);
+}
+
+static void pool_accept(web_worker_t *w)
+{
+    int connfd;
+    while ((connfd = web_accept(pool_listen_fd)) >= 0) {
+        pool_conn_t *pc = calloc(1, sizeof(pool_conn_t));
+        if (!pc) {
+            close(connfd);
+            continue;
+        }
+        web_conn_init(&pc->conn, connfd);
+        pc->worker = w;
+        if (!poller_add(w->poller, connfd, POLLIN, pc))
+            pool_conn_close(pc);
+    }
+}
+
+/* Write responses of jobs just finished */
+static void pool_conn_respond_all(pool_conn_t *pc)
+{
+#ifdef USE_IO_URING
+    if (pc->worker->ring) {
+        uring_conn_service(pc);
+        return;
+    }
+#endif
+    pool_conn_service(pc, 0);
+}
+
+/* Hand finished jobs to their connections */
+static void pool_take_done(web_worker_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+    web_job_t *job = w->done;
+    w->done = w->done_tail = NULL;
+    wakeup_clear(w->done_fd);
+    pthread_mutex_unlock(&w->lock);
+
+    while (job) {
+        web_job_t *next = job->next;
+        pool_conn_t *pc = job->conn;
+        if (pc->dead) {
+            pc->pending -= !job->part;
+            job_free(job);
+            pool_conn_release(pc);
+        } else {
+            job_append(&pc->ready, &pc->ready_tail, job);
+            /* Write once per run of jobs of the same connection */
+            if (!next || next->conn != pc)
+                pool_conn_respond_all(pc);
+        }
+        job = next;
+    }
+}
+
+#ifdef USE_IO_URING
+/* io_uring backend.
+ * A worker whose ring can be set up accepts with one multishot accept,
+ * receives into buffers registered with the kernel, and sends with
+ * io_uring too, so that a batch of requests and responses on many
+ * connections costs a single io_uring_enter.  Out is left alone while a
+ * send from it is in flight, since the kernel may still read it.
+ */
+#define URING_ENTRIES 256
+#define URING_BUFS 64 /* receive buffers, power of 2 */
+#define URING_GROUP 0
+
+/* Operation of completion, in low bits of its user_data */
+enum { OP_ACCEPT, OP_DONE, OP_RECV, OP_SEND, OP_MASK = 3 };
+
+static struct io_uring_sqe *uring_prep(web_worker_t *w,
+                                       int opcode,
+                                       int fd,
+                                       void *tag,
+                                       int op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(w->ring);
+    if (sqe) {
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = (uintptr_t) tag | op;
+    }
+    return sqe;
+}
+
+static void uring_accept(web_worker_t *w)
+{
+    struct io_uring_sqe *sqe =
+        uring_prep(w, IORING_OP_ACCEPT, pool_listen_fd, w, OP_ACCEPT);
+    if (sqe)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/* Learn of finished jobs by polling the wakeup for good */
+static void uring_poll_done(web_worker_t *w)
+{
+    struct io_uring_sqe *sqe =
+        uring_prep(w, IORING_OP_POLL_ADD, w->done_fd[0], w, OP_DONE);
+    if (sqe) {
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+    }
+}
+
+static void uring_recv(pool_conn_t *pc)
+{
+    struct io_uring_sqe *sqe = uring_prep(pc->worker, IORING_OP_RECV,
+                                          pc->conn.fd, pc, OP_RECV);
+    if (!sqe)
+        return;
+    /* Kernel picks a buffer once data has arrived */
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+    pc->receiving = true;
+    pc->inflight++;
+}
+
+/* Send what is in out, reading next part of file into it once it is empty.
+ * Return false if the file cannot be read.
+ */
+static bool uring_send(pool_conn_t *pc)
+{
+    web_conn_t *conn = &pc->conn;
+    if (conn->out_pos == conn->out.len && conn->file_fd >= 0 &&
+        copy_file_chunk(conn) <= 0)
+        return false;
+    if (conn->out_pos == conn->out.len)
+        return true;
+
+    struct io_uring_sqe *sqe =
+        uring_prep(pc->worker, IORING_OP_SEND, conn->fd, pc, OP_SEND);
+    if (!sqe)
+        return false;
+    sqe->addr = (uintptr_t) (conn->out.data + conn->out_pos);
+    sqe->len = conn->out.len - conn->out_pos;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    pc->sending = true;
+    pc->inflight++;
+    return true;
+}
+
+/* Respond, send and hand over requests, and receive more if there is
+ * room, as far as operations in flight allow
+ */
+static void uring_conn_service(pool_conn_t *pc)
+{
+    web_conn_t *conn = &pc->conn;
+    if (!pc->sending) {
+        if (conn->out_pos == conn->out.len && conn->file_fd >= 0 &&
+            conn->file_pos >= conn->file_end) {
+            close(conn->file_fd);
+            conn->file_fd = -1;
+        }
+        if (conn->out_pos == conn->out.len)
+            conn->out.len = conn->out_pos = 0;
+        if (!pool_conn_respond(pc) || !uring_send(pc)) {
+            pool_conn_close(pc);
+            return;
+        }
+    }
+    if (!pool_conn_submit(pc)) {
+        pool_conn_close(pc);
+        return;
+    }
+
+    if (!pc->sending && !pc->pending && (pc->closing || conn->eof)) {
+        pool_conn_close(pc);
+        return;
+    }
+    if (!pc->receiving && !conn->eof && !pc->closing &&
+        pc->pending < PIPELINE_MAX && conn->out.len < WEB_OUT_MAX &&
+        conn->in.len - conn->in_pos < REQUEST_MAX)
+        uring_recv(pc);
+}
+
+static void uring_conn_new(web_worker_t *w, int connfd)
+{
+    pool_conn_t *pc = calloc(1, sizeof(pool_conn_t));
+    if (!pc) {
+        close(connfd);
+        return;
+    }
+    web_conn_init(&pc->conn, connfd);
+    pc->worker = w;
+    /* Sends are batched already; corking would only delay the last one */
+    int off = 0;
+    setsockopt(connfd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    uring_recv(pc);
+}
+
+static void uring_recv_done(pool_conn_t *pc, int res, unsigned flags)
+{
+    web_conn_t *conn = &pc->conn;
+    uring_bufs_t *bufs = pc->worker->bufs;
+    pc->receiving = false;
+    pc->inflight--;
+
+    bool ok = true;
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && !pc->dead) {
+            compact_input(conn);
+            /* Keep one byte for terminating null */
+            ok = web_buf_reserve(&conn->in, res + 1);
+            if (ok) {
+                memcpy(conn->in.data + conn->in.len, uring_buf(bufs, id), res);
+                conn->in.len += res;
+                conn->in.data[conn->in.len] = '\0';
+            }
+        }
+        uring_buf_put(bufs, id);
+    }
+    if (pc->dead) {
+        pool_conn_release(pc);
+        return;
+    }
+
+    if (res == 0)
+        conn->eof = true;
+    /* Out of buffers only means receiving again once some are back */
+    else if ((res < 0 && res != -ENOBUFS) || !ok ||
+             (conn->in.len - conn->in_pos >= REQUEST_MAX &&
+              !request_complete(conn))) {
+        pool_conn_close(pc);
+        return;
+    }
+    uring_conn_service(pc);
+}
+
+static void uring_send_done(pool_conn_t *pc, int res)
+{
+    pc->sending = false;
+    pc->inflight--;
+    if (pc->dead) {
+        pool_conn_release(pc);
+        return;
+    }
+    if (res < 0) {
+        pool_conn_close(pc);
+        return;
+    }
+    pc->conn.out_pos += res;
+    uring_conn_service(pc);
+}
+
+/* Serve connections with io_uring until the pool stops.
+ * Return false if no ring could be set up, leaving the worker to its poller.
+ */
+static bool uring_worker(web_worker_t *w)
+{
+    uring_t ring;
+    uring_bufs_t bufs;
+    if (!uring_init(&ring, URING_ENTRIES))
+        return false;
+    if (!uring_bufs_init(&ring, &bufs, URING_GROUP, URING_BUFS, READ_CHUNK)) {
+        uring_exit(&ring);
+        return false;
+    }
+    w->ring = &ring;
+    w->bufs = &bufs;
+    uring_accept(w);
+    uring_poll_done(w);
+
+    while (!atomic_load(&pool_stopping)) {
+        if (uring_submit(&ring, 1) < 0 && errno != EINTR)
+            break;
+        bool done = false;
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&ring))) {
+            void *tag = (void *) (uintptr_t) (cqe->user_data & ~OP_MASK);
+            int op = cqe->user_data & OP_MASK;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&ring);
+
+            /* Multishot operations are rearmed once they end */
+            if (op == OP_ACCEPT) {
+                if (res >= 0)
+                    uring_conn_new(w, res);
+                if (!(flags & IORING_CQE_F_MORE))
+                    uring_accept(w);
+            } else if (op == OP_DONE) {
+                done = true;
+                if (!(flags & IORING_CQE_F_MORE))
+                    uring_poll_done(w);
+            } else if (op == OP_RECV) {
+                uring_recv_done(tag, res, flags);
+            } else {
+                uring_send_done(tag, res);
+            }
+        }
+        /* Last, since it may free connections with completions above */
+        if (done)
+            pool_take_done(w);
+    }
+
+    /* Let responses handed back go out before the program exits */
+    uring_submit(&ring, 0);
+    uring_exit(&ring);
+    uring_bufs_free(&bufs);
+    w->ring = NULL;
+    return true;
+}
+#endif
+
+static void *worker_main(void *arg)
+{
+    web_worker_t *w = arg;
+    poller_event_t events[MAXEVENTS];
+
+#ifdef USE_IO_URING
+    if (uring_worker(w))
+        return NULL;
+#endif
+    while (!atomic_load(&pool_stopping)) {
+        int n = poller_wait(w->poller, events, MAXEVENTS, -1);
+        bool done = false;
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].tag;
+            if (tag == &pool_listen_fd)
+                pool_accept(w);
+            else if (tag == w)
+                done = true;
+            else
+                pool_conn_service(tag, events[i].events);
+        }
+        /* Last, since it may free connections with events above */
+        if (done)
+            pool_take_done(w);
+    }
+    return NULL;
+}
+
+void web_pool_stop()
+{
+    if (!workers)
+        return;
+    atomic_store(&pool_stopping, true);
+    for (int i = 0; i < nworkers; i++)
+        wakeup_signal(workers[i].done_fd);
+    for (int i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        poller_free(workers[i].poller);
+        wakeup_close(workers[i].done_fd);
+    }
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+}
+
+static bool worker_start(web_worker_t *w)
+{
+    pthread_mutex_init(&w->lock, NULL);
+    if (!wakeup_open(w->done_fd) || !(w->poller = poller_new()))
+        return false;
+
+    /* Only one worker is woken for each connection arriving */
+    if (!poller_add(w->poller, pool_listen_fd, POLLIN | POLLER_EXCLUSIVE,
+                    &pool_listen_fd) ||
+        !poller_add(w->poller, w->done_fd[0], POLLIN, w))
+        return false;
+
+    /* Time limits and interrupts are for the interpreter thread, and a
+     * client hanging up makes writes fail, rather than end the program
+     */
+    sigset_t mask, saved;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, &saved);
+    bool ok = !pthread_create(&w->thread, NULL, worker_main, w);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return ok;
+}
+
+int web_pool_start(int listenfd, int count)
+{
+    static bool registered = false;
+
+    if (workers)
+        return -1;
+    if (job_fd[0] < 0)
+        wakeup_open(job_fd);
+    workers = calloc(count, sizeof(web_worker_t));
+    if (job_fd[0] < 0 || !workers)
+        return -1;
+
+    pool_listen_fd = listenfd;
+    atomic_store(&pool_stopping, false);
+    for (int i = 0; i < count; i++) {
+        web_worker_t *w = &workers[i];
+        if (!worker_start(w)) {
+            poller_free(w->poller);
+            wakeup_close(w->done_fd);
+            web_pool_stop();
+            return -1;
+        }
+        nworkers++;
+    }
+
+    /* Let responses already handed back go out before the program exits */
+    if (!registered) {
+        atexit(web_pool_stop);
+        registered = true;
+    }
+    return job_fd[0];
+}
@@ -2,11 +2,134 @@
 #define TINYWEB_H
 
 #include <netinet/in.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Growable byte buffer */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} web_buf_t;
+
+/* Make room for n more bytes.  Return false if out of memory */
+bool web_buf_reserve(web_buf_t *buf, size_t n);
+
+bool web_buf_append(web_buf_t *buf, const char *data, size_t len);
+
+/* Append formatted text.  Return false if out of memory */
+bool web_buf_vprintf(web_buf_t *buf, const char *fmt, va_list ap);
+
+void web_buf_free(web_buf_t *buf);
+
+/* Persistent connection, read and written without blocking.
+ * Requests may be pipelined: every complete one in the input is served
+ * in turn, and the responses are queued for writing.
+ */
+typedef struct {
+    int fd;
+    web_buf_t in;    /* Bytes received */
+    size_t in_pos;   /* Start of first request not yet served */
+    web_buf_t out;   /* Responses not yet written */
+    size_t out_pos;  /* Bytes of out already written */
+    bool keep_alive; /* Connection persists after last response */
+    bool eof;        /* Client has finished sending */
+    bool http11;     /* Client takes chunked responses */
+    bool chunked;    /* Response being sent in chunks */
+    bool batch;      /* Last request taken holds several commands */
+    int error;       /* Status last request taken was refused with, or 0 */
+    int file_fd;     /* File to send once out is written, or -1 */
+    off_t file_pos;  /* Next byte of file to send */
+    off_t file_end;  /* End of file as of response header */
+} web_conn_t;
+
+int set_nonblocking(int fd, bool on);
 
 int web_open(int port);
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr);
+/* Accept connection on listening socket, set nonblocking.
+ * Return -1 if there is none waiting.
+ */
+int web_accept(int listenfd);
+
+void web_conn_init(web_conn_t *conn, int fd);
+
+/* Release buffers of connection.  Does not close it */
+void web_conn_free(web_conn_t *conn);
+
+/* Read everything that has arrived on connection.
+ * Return 0, or -1 if the connection failed.
+ */
+int web_conn_read(web_conn_t *conn);
+
+/* Take next complete request, and return its command, allocated with
+ * malloc.  A POST with a body is a batch: its body is returned instead,
+ * with one command per line, and batch is set.  Return NULL if no
+ * complete request has arrived, or if the request is refused, as error
+ * then tells.  Input after a refused request is discarded.
+ */
+char *web_conn_next(web_conn_t *conn);
+
+/* Queue error response with status, closing connection after it */
+bool web_conn_refuse(web_conn_t *conn, int status);
+
+/* Queue response with body.  Return false if out of memory */
+bool web_conn_respond(web_conn_t *conn, const char *body, size_t len);
+
+/* Queue part of response body, starting a chunked response first if this
+ * is the first part.  Return false if out of memory.
+ */
+bool web_conn_output(web_conn_t *conn, const char *data, size_t len);
+
+/* Complete response with rest of body: the last chunk if the response is
+ * chunked, or else all of it.  Return false if out of memory.
+ */
+bool web_conn_end(web_conn_t *conn, const char *body, size_t len);
+
+/* Queue response with contents of file, which the connection then owns.
+ * Until it has been written, no further response can be queued.
+ */
+bool web_conn_send_file(web_conn_t *conn, int fd);
+
+/* Write queued responses.
+ * Return 1 when all are written, 0 if the socket is full, -1 on error.
+ */
+int web_conn_flush(web_conn_t *conn);
+
+/* Request handed by a web worker to the interpreter thread */
+typedef struct web_job {
+    struct web_job *next;
+    char *cmd;       /* Command of request */
+    int status;      /* Refuse request with this status instead, if set */
+    web_buf_t body;  /* Response text, filled in by interpreter */
+    int file_fd;     /* File to send instead, which the job then owns */
+    bool keep_alive; /* As asked for by request */
+    bool http11;
+    bool batch; /* Cmd holds one command per line */
+    bool part;  /* Output so far of job still running */
+    void *conn; /* Connection the response goes to */
+} web_job_t;
+
+/* Start count worker threads serving connections to listenfd.
+ * Return descriptor that is readable while jobs are waiting, or -1.
+ */
+int web_pool_start(int listenfd, int count);
+
+/* Take next waiting job, or return NULL.  Interpreter thread only */
+web_job_t *web_pool_take();
+
+/* Hand back job with its response filled in */
+void web_pool_done(web_job_t *job);
+
+/* Receive command output for job, as sink for set_report_capture.
+ * Once output is large, it is handed back in parts as it is produced, and
+ * an HTTP/1.1 client receives them in chunks while the job still runs.
+ */
+void web_job_output(void *job, const char *text, size_t len);
 
-void web_send(int out_fd, char *buffer);
+/* Stop workers, after they write what they can of responses handed back */
+void web_pool_stop();
 
 #endif
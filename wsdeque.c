@@ -0,0 +1,298 @@
+/* Chase-Lev work-stealing deque, with the C11 memory orderings of Le et al.,
+ * "Correct and Efficient Work-Stealing for Weak Memory Models"
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "wsdeque.h"
+
+#define relaxed memory_order_relaxed
+#define acquire memory_order_acquire
+#define release memory_order_release
+#define seq_cst memory_order_seq_cst
+
+static ws_array_t *array_new(int64_t size)
+{
+    ws_array_t *a = malloc(sizeof(ws_array_t) + size * sizeof(void *));
+    if (!a)
+        return NULL;
+    a->prev = NULL;
+    a->size = size;
+    return a;
+}
+
+bool ws_deque_init(ws_deque_t *q, int64_t size)
+{
+    ws_array_t *a = array_new(size);
+    if (!a)
+        return false;
+    atomic_init(&q->top, 0);
+    atomic_init(&q->bottom, 0);
+    atomic_init(&q->array, a);
+    return true;
+}
+
+void ws_deque_free(ws_deque_t *q)
+{
+    ws_array_t *a = atomic_load_explicit(&q->array, relaxed);
+    while (a) {
+        ws_array_t *prev = a->prev;
+        free(a);
+        a = prev;
+    }
+}
+
+/* Copy items into array twice the size.  Only the owner calls this */
+static ws_array_t *grow(ws_deque_t *q, ws_array_t *a, int64_t t, int64_t b)
+{
+    ws_array_t *bigger = array_new(a->size * 2);
+    if (!bigger)
+        return NULL;
+    for (int64_t i = t; i < b; i++) {
+        void *item = atomic_load_explicit(&a->buf[i & (a->size - 1)], relaxed);
+        atomic_store_explicit(&bigger->buf[i & (bigger->size - 1)], item,
+                              relaxed);
+    }
+    bigger->prev = a;
+    atomic_store_explicit(&q->array, bigger, release);
+    return bigger;
+}
+
+bool ws_deque_push(ws_deque_t *q, void *item)
+{
+    int64_t b = atomic_load_explicit(&q->bottom, relaxed);
+    int64_t t = atomic_load_explicit(&q->top, acquire);
+    ws_array_t *a = atomic_load_explicit(&q->array, relaxed);
+    if (b - t > a->size - 1 && !(a = grow(q, a, t, b)))
+        return false;
+    atomic_store_explicit(&a->buf[b & (a->size - 1)], item, relaxed);
+    /* Release store rather than the paper's fence, to the same effect */
+    atomic_store_explicit(&q->bottom, b + 1, release);
+    return true;
+}
+
+void *ws_deque_pop(ws_deque_t *q)
+{
+    int64_t b = atomic_load_explicit(&q->bottom, relaxed) - 1;
+    ws_array_t *a = atomic_load_explicit(&q->array, relaxed);
+    atomic_store_explicit(&q->bottom, b, relaxed);
+    /* Thieves must see bottom lowered before top is read */
+    atomic_thread_fence(seq_cst);
+    int64_t t = atomic_load_explicit(&q->top, relaxed);
+
+    if (t > b) {
+        /* Was empty */
+        atomic_store_explicit(&q->bottom, b + 1, relaxed);
+        return NULL;
+    }
+    void *item = atomic_load_explicit(&a->buf[b & (a->size - 1)], relaxed);
+    if (t == b) {
+        /* Last item; race thieves for it */
+        if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+                                                     seq_cst, relaxed))
+            item = NULL;
+        atomic_store_explicit(&q->bottom, b + 1, relaxed);
+    }
+    return item;
+}
+
+void *ws_deque_steal(ws_deque_t *q)
+{
+    int64_t t = atomic_load_explicit(&q->top, acquire);
+    atomic_thread_fence(seq_cst);
+    int64_t b = atomic_load_explicit(&q->bottom, acquire);
+    if (t >= b)
+        return NULL;
+
+    ws_array_t *a = atomic_load_explicit(&q->array, acquire);
+    void *item = atomic_load_explicit(&a->buf[t & (a->size - 1)], relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1, seq_cst,
+                                                 relaxed))
+        return WS_ABORT;
+    return item;
+}
+
+/* Fork-join benchmark */
+
+#define DEQUE_SIZE 64
+
+typedef struct {
+    int depth;
+    uint64_t result;
+    atomic_bool done;
+} task_t;
+
+typedef struct bench bench_t;
+
+typedef struct {
+    pthread_t thread;
+    ws_deque_t deque;
+    bench_t *bench;
+    uint64_t seed; /* For picking victims */
+    uint64_t tasks, steals, attempts;
+} worker_t;
+
+struct bench {
+    worker_t *workers;
+    int nworkers;
+    int work;
+    atomic_bool finished;
+};
+
+static uint64_t xorshift(uint64_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static uint64_t leaf(int work)
+{
+    uint64_t x = 88172645463325252ULL;
+    for (int i = 0; i < work; i++)
+        xorshift(&x);
+    return x;
+}
+
+static void task_init(task_t *t, int depth)
+{
+    t->depth = depth;
+    t->result = 0;
+    atomic_init(&t->done, false);
+}
+
+static void run_task(worker_t *w, task_t *t);
+
+/* Take task from random victim and run it.  Return false if none was taken */
+static bool steal_one(worker_t *w)
+{
+    bench_t *bench = w->bench;
+    if (bench->nworkers < 2)
+        return false;
+    int self = w - bench->workers;
+    int victim = xorshift(&w->seed) % (bench->nworkers - 1);
+    if (victim >= self)
+        victim++;
+    w->attempts++;
+    task_t *t = ws_deque_steal(&bench->workers[victim].deque);
+    if (!t || t == WS_ABORT)
+        return false;
+    w->steals++;
+    run_task(w, t);
+    return true;
+}
+
+/* Wait for forked task, running it here unless it was stolen, and helping
+ * with other work while its thief finishes it
+ */
+static void join(worker_t *w, task_t *t)
+{
+    while (!atomic_load_explicit(&t->done, acquire)) {
+        task_t *mine = ws_deque_pop(&w->deque);
+        if (mine)
+            run_task(w, mine);
+        else if (!steal_one(w))
+            sched_yield();
+    }
+}
+
+static void run_task(worker_t *w, task_t *t)
+{
+    w->tasks++;
+    if (!t->depth) {
+        t->result = leaf(w->bench->work);
+    } else {
+        task_t left, right;
+        task_init(&left, t->depth - 1);
+        task_init(&right, t->depth - 1);
+        if (!ws_deque_push(&w->deque, &left))
+            run_task(w, &left);
+        run_task(w, &right);
+        join(w, &left);
+        t->result = left.result + right.result;
+    }
+    atomic_store_explicit(&t->done, true, release);
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = arg;
+    while (!atomic_load_explicit(&w->bench->finished, acquire)) {
+        if (!steal_one(w))
+            sched_yield();
+    }
+    return NULL;
+}
+
+static uint64_t time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool ws_bench_run(int threads, int depth, int work, ws_bench_t *result)
+{
+    bench_t bench = {.nworkers = threads, .work = work};
+    atomic_init(&bench.finished, false);
+    bench.workers = calloc(threads, sizeof(worker_t));
+    if (!bench.workers)
+        return false;
+    int ready = 0;
+    for (; ready < threads; ready++) {
+        worker_t *w = &bench.workers[ready];
+        if (!ws_deque_init(&w->deque, DEQUE_SIZE))
+            break;
+        w->bench = &bench;
+        w->seed = 0x9e3779b97f4a7c15ULL * (ready + 1);
+    }
+
+    /* Calling thread is worker 0 and runs the root task.  Time limits and
+     * interrupts stay with it.
+     */
+    sigset_t mask, saved;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &saved);
+    int started = 1;
+    if (ready == threads) {
+        for (; started < threads; started++) {
+            worker_t *w = &bench.workers[started];
+            if (pthread_create(&w->thread, NULL, worker_main, w))
+                break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    bool ok = ready == threads && started == threads;
+
+    task_t root;
+    task_init(&root, depth);
+    uint64_t start = time_ns();
+    if (ok)
+        run_task(&bench.workers[0], &root);
+    uint64_t end = time_ns();
+    atomic_store_explicit(&bench.finished, true, release);
+    for (int i = 1; i < started; i++)
+        pthread_join(bench.workers[i].thread, NULL);
+
+    /* Every leaf yields the same value, whoever runs it */
+    *result = (ws_bench_t){
+        .ns = end - start,
+        .valid = ok && root.result == leaf(work) << depth,
+    };
+    for (int i = 0; i < ready; i++) {
+        worker_t *w = &bench.workers[i];
+        result->tasks += w->tasks;
+        result->steals += w->steals;
+        result->attempts += w->attempts;
+        ws_deque_free(&w->deque);
+    }
+    free(bench.workers);
+    return ok;
+}
@@ -0,0 +1,63 @@
+#ifndef LAB0_WSDEQUE_H
+#define LAB0_WSDEQUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Chase-Lev work-stealing deque.
+ *
+ * The thread owning the deque pushes and pops at the bottom, like the tail of
+ * a stack, while any other thread may steal from the top.  The owner only
+ * contends with thieves when one item is left.  The array grows when full;
+ * arrays it outgrows stay allocated until the deque is freed, since a thief
+ * may still be reading them.
+ */
+
+typedef struct ws_array {
+    struct ws_array *prev; /* Array outgrown before this one */
+    int64_t size;          /* Power of 2 */
+    _Atomic(void *) buf[];
+} ws_array_t;
+
+typedef struct {
+    _Alignas(64) atomic_int_fast64_t top;    /* Next item thieves take */
+    _Alignas(64) atomic_int_fast64_t bottom; /* Next slot owner fills */
+    _Atomic(ws_array_t *) array;
+} ws_deque_t;
+
+/* Returned by ws_deque_steal when another thread took the item first */
+#define WS_ABORT ((void *) -1)
+
+/* Set up deque with room for size items, a power of 2 */
+bool ws_deque_init(ws_deque_t *q, int64_t size);
+
+void ws_deque_free(ws_deque_t *q);
+
+/* Owner adds item at bottom.  Return false if the array could not grow */
+bool ws_deque_push(ws_deque_t *q, void *item);
+
+/* Owner takes item at bottom, or NULL if the deque is empty */
+void *ws_deque_pop(ws_deque_t *q);
+
+/* Take item at top, or NULL if the deque is empty, or WS_ABORT if the race
+ * for it was lost
+ */
+void *ws_deque_steal(ws_deque_t *q);
+
+/* Results of fork-join benchmark */
+typedef struct {
+    uint64_t tasks;    /* Tasks run */
+    uint64_t steals;   /* Tasks taken from another worker */
+    uint64_t attempts; /* Steals tried, including failed ones */
+    uint64_t ns;       /* Wall time */
+    bool valid;        /* Leaf results added up to the expected total */
+} ws_bench_t;
+
+/* Run binary tree of tasks depth levels deep on threads workers, each task
+ * forking two children and joining them, and each leaf spinning for work
+ * iterations.  Return false if workers could not be started.
+ */
+bool ws_bench_run(int threads, int depth, int work, ws_bench_t *result);
+
+#endif /* LAB0_WSDEQUE_H */